@@ -0,0 +1,404 @@
+// doops benchmarks, one JSON object per line on stdout
+//   cc -O2 benchmark.c -o benchmark -lpthread                  (epoll/kqueue)
+//   cc -O2 -DWITH_POLL benchmark.c -o benchmark -lpthread
+//   cc -O2 -DWITH_SELECT benchmark.c -o benchmark -lpthread
+//   ./benchmark [timers] [pingpong] [idle] [http]
+#include "doops.h"
+#include <stdio.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef WITH_IO_URING
+    #define BENCH_BACKEND   "io_uring"
+#elif defined(WITH_EPOLL)
+    #define BENCH_BACKEND   "epoll"
+#elif defined(WITH_KQUEUE)
+    #define BENCH_BACKEND   "kqueue"
+#elif defined(WITH_POLL)
+    #define BENCH_BACKEND   "poll"
+#else
+    #define BENCH_BACKEND   "select"
+#endif
+
+#define PINGPONG_ROUNDS     100000
+#define IDLE_ROUNDS         20000
+#define HTTP_REQUESTS       20000
+#define HTTP_CLIENTS        4
+
+#define HTTP_RESPONSE       "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-type: text/html\r\nContent-length: 11\r\n\r\nhello world"
+
+static uint64_t nanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// sorts samples
+static uint64_t percentile(uint64_t *samples, unsigned int count, unsigned int pct) {
+    if (!count)
+        return 0;
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+    return samples[(uint64_t)(count - 1) * pct / 100];
+}
+
+static void report(const char *benchmark, unsigned int n, const char *metrics) {
+    fprintf(stdout, "{\"backend\": \"%s\", \"benchmark\": \"%s\", \"n\": %u, %s}\n", BENCH_BACKEND, benchmark, n, metrics);
+    fflush(stdout);
+}
+
+static void report_latency(const char *benchmark, unsigned int n, uint64_t elapsed, uint64_t *samples, unsigned int count) {
+    char metrics[256];
+    snprintf(metrics, sizeof(metrics), "\"ns_per_op\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, \"ops_per_sec\": %.0f",
+        count ? (double)elapsed / count : 0.0,
+        (unsigned long long)percentile(samples, count, 50), (unsigned long long)percentile(samples, count, 99), (unsigned long long)percentile(samples, count, 100),
+        elapsed ? count * 1e9 / elapsed : 0.0);
+    report(benchmark, n, metrics);
+}
+
+static void report_ns(const char *benchmark, unsigned int n, uint64_t elapsed) {
+    char metrics[128];
+    snprintf(metrics, sizeof(metrics), "\"ns_per_op\": %.1f", n ? (double)elapsed / n : 0.0);
+    report(benchmark, n, metrics);
+}
+
+static int nonblocking_pair(int *sv) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+        return -1;
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+// timer churn
+static unsigned int fired;
+
+static int timer_callback(struct doops_loop *loop) {
+    fired ++;
+    return 1;
+}
+
+static void bench_timers(unsigned int n) {
+    struct doops_loop loop;
+    struct doops_timer *handles = (struct doops_timer *)malloc(sizeof(struct doops_timer) * n);
+    unsigned int i;
+    uint64_t start;
+    if (!handles)
+        return;
+
+    // far away deadlines, nothing fires
+    loop_init(&loop);
+    start = nanoseconds();
+    for (i = 0; i < n; i ++)
+        loop_add(&loop, timer_callback, 1000000 + (i * 7919) % 1000000, NULL);
+    report_ns("timer_add", n, nanoseconds() - start);
+
+    start = nanoseconds();
+    loop_remove(&loop, timer_callback, NULL);
+    report_ns("timer_remove_all", n, nanoseconds() - start);
+    loop_deinit(&loop);
+
+    loop_init(&loop);
+    for (i = 0; i < n; i ++)
+        handles[i] = loop_add_timer(&loop, timer_callback, 1000000 + (i * 7919) % 1000000, NULL);
+    // cancel in a scattered order
+    start = nanoseconds();
+    for (i = 0; i < n; i ++)
+        loop_timer_cancel(&handles[((uint64_t)i * 7919) % n]);
+    report_ns("timer_cancel", n, nanoseconds() - start);
+    loop_deinit(&loop);
+
+    loop_init(&loop);
+    for (i = 0; i < n; i ++)
+        handles[i] = loop_add_timer(&loop, timer_callback, 1000000, NULL);
+    start = nanoseconds();
+    for (i = 0; i < n; i ++)
+        loop_timer_reschedule(&handles[i], 1000 + (i * 7919) % 1000000);
+    report_ns("timer_reschedule", n, nanoseconds() - start);
+    loop_deinit(&loop);
+
+    loop_init(&loop);
+    for (i = 0; i < n; i ++)
+        loop_add(&loop, timer_callback, 0, NULL);
+    fired = 0;
+    start = nanoseconds();
+    while (fired < n)
+        loop_iterate(&loop);
+    report_ns("timer_fire", n, nanoseconds() - start);
+    loop_deinit(&loop);
+
+    free(handles);
+}
+
+// socketpair ping-pong, both ends served by the same loop
+struct pingpong {
+    int sv[2];
+    unsigned int rounds;
+    unsigned int count;
+    uint64_t sent;
+    uint64_t *samples;
+};
+
+static void pingpong_on_ping(struct doops_loop *loop, int fd) {
+    struct pingpong *pp = (struct pingpong *)loop_event_data(loop);
+    char buf[16];
+    if (read(fd, buf, sizeof(buf)) <= 0)
+        return;
+    uint64_t now = nanoseconds();
+    pp->samples[pp->count ++] = now - pp->sent;
+    if (pp->count >= pp->rounds) {
+        loop_remove_io(loop, pp->sv[0]);
+        loop_remove_io(loop, pp->sv[1]);
+        // the idle connections are still registered
+        loop_quit(loop);
+        return;
+    }
+    pp->sent = nanoseconds();
+    if (write(fd, "p", 1) != 1)
+        perror("write");
+}
+
+static void pingpong_on_pong(struct doops_loop *loop, int fd) {
+    char buf[16];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if ((len > 0) && (write(fd, buf, len) != len))
+        perror("write");
+}
+
+static int pingpong_run(struct doops_loop *loop, struct pingpong *pp, unsigned int rounds) {
+    pp->rounds = rounds;
+    pp->count = 0;
+    pp->samples = (uint64_t *)malloc(sizeof(uint64_t) * rounds);
+    if ((!pp->samples) || (nonblocking_pair(pp->sv))) {
+        free(pp->samples);
+        return -1;
+    }
+    if ((loop_add_io_cb(loop, pp->sv[0], DOOPS_READ, pingpong_on_ping, NULL, pp)) || (loop_add_io_cb(loop, pp->sv[1], DOOPS_READ, pingpong_on_pong, NULL, pp))) {
+        perror("loop_add_io_cb");
+        close(pp->sv[0]);
+        close(pp->sv[1]);
+        free(pp->samples);
+        return -1;
+    }
+    pp->sent = nanoseconds();
+    if (write(pp->sv[0], "p", 1) != 1)
+        perror("write");
+    loop_run(loop);
+    close(pp->sv[0]);
+    close(pp->sv[1]);
+    return 0;
+}
+
+static void bench_pingpong() {
+    struct doops_loop loop;
+    struct pingpong pp;
+    loop_init(&loop);
+    uint64_t start = nanoseconds();
+    if (!pingpong_run(&loop, &pp, PINGPONG_ROUNDS)) {
+        report_latency("pingpong", PINGPONG_ROUNDS, nanoseconds() - start, pp.samples, pp.count);
+        free(pp.samples);
+    }
+    loop_deinit(&loop);
+}
+
+// ping-pong on one socketpair while n idle connections are registered
+static void bench_idle(unsigned int n) {
+    struct doops_loop loop;
+    struct pingpong pp;
+    int *idle = (int *)malloc(sizeof(int) * n * 2);
+    unsigned int i;
+    unsigned int opened = 0;
+    if (!idle)
+        return;
+    loop_init(&loop);
+    for (i = 0; i < n; i ++) {
+        if (nonblocking_pair(idle + i * 2))
+            break;
+        opened += 2;
+        if (loop_add_io(&loop, idle[i * 2], DOOPS_READ))
+            break;
+    }
+    if (i == n) {
+        uint64_t start = nanoseconds();
+        if (!pingpong_run(&loop, &pp, IDLE_ROUNDS)) {
+            report_latency("idle_wakeup", n, nanoseconds() - start, pp.samples, pp.count);
+            free(pp.samples);
+        }
+    } else {
+        char metrics[64];
+        snprintf(metrics, sizeof(metrics), "\"skipped\": \"%s\"", strerror(errno));
+        report("idle_wakeup", n, metrics);
+    }
+    for (i = 0; i < opened; i ++)
+        close(idle[i]);
+    loop_deinit(&loop);
+    free(idle);
+}
+
+#if !defined(DOOPS_NO_THREADS) && !defined(DOOPS_NO_IO_EVENTS)
+// HTTP hello world, the server is modeled on example.c and the clients run on their own threads
+struct http_client {
+    struct doops_loop *loop;
+    struct sockaddr_in addr;
+    unsigned int requests;
+    unsigned int count;
+    uint64_t *samples;
+};
+
+static unsigned int http_clients_done;
+static int http_listener;
+
+static void http_on_request(struct doops_loop *loop, int fd) {
+    char buf[1024];
+    if (read(fd, buf, sizeof(buf)) > 0) {
+        if (send(fd, HTTP_RESPONSE, sizeof(HTTP_RESPONSE) - 1, 0) < 0)
+            perror("send");
+    }
+    loop_remove_io(loop, fd);
+    close(fd);
+}
+
+static void http_on_accept(struct doops_loop *loop, int fd, void *data) {
+    loop_add_io_cb(loop, fd, DOOPS_READ, http_on_request, NULL, NULL);
+}
+
+// posted by the client threads, the loop exits when the listener is removed
+static int http_client_done(struct doops_loop *loop) {
+    if (++ http_clients_done == HTTP_CLIENTS)
+        loop_remove_listener(loop, http_listener);
+    return 0;
+}
+
+static void *http_client_thread(void *data) {
+    struct http_client *client = (struct http_client *)data;
+    static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    char buf[1024];
+    unsigned int i;
+    for (i = 0; i < client->requests; i ++) {
+        uint64_t start = nanoseconds();
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            break;
+        if ((connect(fd, (struct sockaddr *)&client->addr, sizeof(client->addr))) || (send(fd, request, sizeof(request) - 1, 0) < 0)) {
+            close(fd);
+            break;
+        }
+        while (recv(fd, buf, sizeof(buf), 0) > 0)
+            ;
+        close(fd);
+        client->samples[client->count ++] = nanoseconds() - start;
+    }
+    loop_post(client->loop, http_client_done, NULL);
+    return NULL;
+}
+
+static void bench_http() {
+    struct doops_loop loop;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    struct http_client clients[HTTP_CLIENTS];
+    pthread_t threads[HTTP_CLIENTS];
+    int started[HTTP_CLIENTS];
+    uint64_t *samples = (uint64_t *)malloc(sizeof(uint64_t) * HTTP_REQUESTS);
+    unsigned int i;
+    unsigned int count = 0;
+    int one = 1;
+    if (!samples)
+        return;
+
+    http_listener = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(http_listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((bind(http_listener, (struct sockaddr *)&addr, sizeof(addr))) || (listen(http_listener, 1024)) || (getsockname(http_listener, (struct sockaddr *)&addr, &len))) {
+        perror("listen");
+        close(http_listener);
+        free(samples);
+        return;
+    }
+
+    loop_init(&loop);
+    if (loop_add_listener(&loop, http_listener, http_on_accept, NULL)) {
+        // the clients would wait for a response forever
+        perror("loop_add_listener");
+        loop_deinit(&loop);
+        close(http_listener);
+        free(samples);
+        return;
+    }
+    http_clients_done = 0;
+    uint64_t start = nanoseconds();
+    for (i = 0; i < HTTP_CLIENTS; i ++) {
+        clients[i].loop = &loop;
+        clients[i].addr = addr;
+        clients[i].requests = HTTP_REQUESTS / HTTP_CLIENTS;
+        clients[i].count = 0;
+        clients[i].samples = samples + i * (HTTP_REQUESTS / HTTP_CLIENTS);
+        started[i] = !pthread_create(&threads[i], NULL, http_client_thread, &clients[i]);
+        if (!started[i])
+            http_client_done(&loop);
+    }
+    loop_run(&loop);
+    uint64_t elapsed = nanoseconds() - start;
+    for (i = 0; i < HTTP_CLIENTS; i ++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        // keep the samples contiguous
+        memmove(samples + count, clients[i].samples, sizeof(uint64_t) * clients[i].count);
+        count += clients[i].count;
+    }
+    report_latency("http_hello", HTTP_REQUESTS, elapsed, samples, count);
+    loop_deinit(&loop);
+    close(http_listener);
+    free(samples);
+}
+#endif
+
+static int selected(int argc, char **argv, const char *name) {
+    int i;
+    if (argc < 2)
+        return 1;
+    for (i = 1; i < argc; i ++) {
+        if (!strcmp(argv[i], name))
+            return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static const unsigned int timer_counts[] = { 1000, 10000, 100000, 1000000 };
+    static const unsigned int idle_counts[] = { 10, 100, 400, 1000, 10000 };
+    unsigned int i;
+    struct rlimit limit;
+
+    // the idle benchmark needs two descriptors per connection
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (selected(argc, argv, "timers")) {
+        for (i = 0; i < sizeof(timer_counts) / sizeof(timer_counts[0]); i ++)
+            bench_timers(timer_counts[i]);
+    }
+    if (selected(argc, argv, "pingpong"))
+        bench_pingpong();
+    if (selected(argc, argv, "idle")) {
+        for (i = 0; i < sizeof(idle_counts) / sizeof(idle_counts[0]); i ++)
+            bench_idle(idle_counts[i]);
+    }
+#if !defined(DOOPS_NO_THREADS) && !defined(DOOPS_NO_IO_EVENTS)
+    if (selected(argc, argv, "http"))
+        bench_http();
+#endif
+    return 0;
+}
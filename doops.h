@@ -7,6 +7,23 @@
 #include <inttypes.h>
 #include <string.h>
 
+#if defined(__cplusplus) && !defined(DOOPS_NO_COROUTINES) && defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+    #define DOOPS_COROUTINES
+    #include <coroutine>
+    #include <exception>
+    #include <new>
+#endif
+#endif
+
+#if defined(__cplusplus) && !defined(DOOPS_NO_FUNCTORS) && ((__cplusplus >= 201103L) || (defined(_MSVC_LANG) && (_MSVC_LANG >= 201103L)))
+    #define DOOPS_FUNCTORS
+    #include <new>
+    #include <cstddef>
+    #include <type_traits>
+    #include <utility>
+#endif
+
 #ifdef _WIN32
     #ifndef WITH_POLL
         #define WITH_SELECT
@@ -15,7 +32,7 @@
 #else
     #define DOOPS_SPINLOCK_TYPE int
 #ifdef __linux__
-    #if !defined(WITH_POLL) && !defined(WITH_SELECT)
+    #if !defined(WITH_POLL) && !defined(WITH_SELECT) && !defined(WITH_IO_URING)
         #define WITH_EPOLL
     #endif
 #else
@@ -37,6 +54,29 @@
 
 #ifdef WITH_EPOLL
     #include <sys/epoll.h>
+    #include <sys/timerfd.h>
+    #include <sys/eventfd.h>
+    #ifndef CLOCK_MONOTONIC
+        // hidden by strict ISO C modes, same value on every Linux architecture
+        #define CLOCK_MONOTONIC 1
+    #endif
+#endif
+#ifdef WITH_IO_URING
+    #include <linux/io_uring.h>
+    #include <sys/syscall.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/eventfd.h>
+    #include <poll.h>
+    #if !defined(__cplusplus) && !defined(_GNU_SOURCE) && !defined(_DEFAULT_SOURCE) && !defined(_BSD_SOURCE)
+        // hidden by strict ISO C modes
+        long syscall(long number, ...);
+    #endif
+    #ifdef MAP_POPULATE
+        #define DOOPS_URING_MMAP    (MAP_SHARED | MAP_POPULATE)
+    #else
+        #define DOOPS_URING_MMAP    MAP_SHARED
+    #endif
 #endif
 #ifdef WITH_KQUEUE
     #include <sys/types.h>
@@ -51,7 +91,31 @@
 #endif
 
 #define DOOPS_MAX_SLEEP     500
+// longest wait of a tickless loop (ms), keeps the timeout in an int of microseconds
+#ifndef DOOPS_MAX_TICKLESS_SLEEP
+    #define DOOPS_MAX_TICKLESS_SLEEP    2000000
+#endif
 #define DOOPS_MAX_EVENTS    1024
+// epoll/kqueue wait buffer, resized between DOOPS_WAIT_EVENTS_MIN and loop_set_max_events (default DOOPS_WAIT_EVENTS_MAX)
+#ifndef DOOPS_WAIT_EVENTS_MIN
+    #define DOOPS_WAIT_EVENTS_MIN   64
+#endif
+#ifndef DOOPS_WAIT_EVENTS_MAX
+    #define DOOPS_WAIT_EVENTS_MAX   65536
+#endif
+// consecutive waits using at most a quarter of the buffer before it is halved
+#define DOOPS_WAIT_SHRINK   32
+#define DOOPS_TIMER_DETACHED ((unsigned int)-1)
+
+// fire at microsecond precision instead of rounding up to the next millisecond
+#define DOOPS_EVENT_PRECISE 0x01
+// rescheduled from its own callback
+#define DOOPS_EVENT_RESCHEDULED 0x02
+// per-fd callable (C++) currently running, released when it returns
+#define DOOPS_EVENT_RUNNING 0x04
+#define DOOPS_EVENT_RELEASED 0x08
+// continuation scheduled by the library, its user_data is not passed to udata_free and loop_remove/loop_foreach skip it
+#define DOOPS_EVENT_INTERNAL 0x10
 
 #if !defined(DOOPS_FREE) || !defined(DOOPS_MALLOC) || !defined(DOOPS_REALLOC)
     #define DOOPS_MALLOC(bytes)         malloc(bytes)
@@ -90,6 +154,39 @@
 #else
     #include <sys/time.h>
     #include <unistd.h>
+    #include <fcntl.h>
+#ifndef DOOPS_NO_IO_EVENTS
+    #include <sys/socket.h>
+    #include <sys/uio.h>
+    #include <sys/stat.h>
+    #include <signal.h>
+#if defined(__linux__)
+    #include <sys/sendfile.h>
+    #include <sys/signalfd.h>
+    #if !defined(__cplusplus) && !defined(_GNU_SOURCE)
+        // provided by every Linux libc, but only declared with _GNU_SOURCE
+        int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+    #endif
+#endif
+#endif
+#endif
+
+// the POSIX signal functions are hidden by strict ISO C modes
+#if !defined(DOOPS_NO_IO_EVENTS) && !defined(_WIN32) && (defined(SIG_BLOCK) || defined(WITH_KQUEUE))
+    #define DOOPS_SIGNALS
+#endif
+
+#ifndef DOOPS_NO_THREADS
+#ifdef _WIN32
+    #define DOOPS_THREAD_TYPE HANDLE
+    #define DOOPS_MUTEX_TYPE CRITICAL_SECTION
+    #define DOOPS_COND_TYPE CONDITION_VARIABLE
+#else
+    #include <pthread.h>
+    #define DOOPS_THREAD_TYPE pthread_t
+    #define DOOPS_MUTEX_TYPE pthread_mutex_t
+    #define DOOPS_COND_TYPE pthread_cond_t
+#endif
 #endif
 
 #define DOOPS_READ      0
@@ -97,6 +194,13 @@
 
 struct doops_loop;
 
+#ifdef DOOPS_COROUTINES
+namespace doops {
+    struct io_awaiter;
+    struct sleep_awaiter;
+}
+#endif
+
 #ifdef __cplusplus
     #define PRIVATE_LOOP_MAKE_ANON_FUNCTION(x, y) private_lambda_call_ ## x ## y
     #define PRIVATE_LOOP_MAKE_ANON_FUNCTION_NAME(x, y) PRIVATE_LOOP_MAKE_ANON_FUNCTION(x, y)
@@ -213,13 +317,22 @@ typedef int (*doop_callback)(struct doops_loop *loop);
 typedef int (*doop_foreach_callback)(struct doops_loop *loop, void *foreachdata);
 typedef int (*doop_idle_callback)(struct doops_loop *loop);
 typedef void (*doop_io_callback)(struct doops_loop *loop, int fd);
+typedef void (*doop_signal_callback)(struct doops_loop *loop, int signo);
 typedef void (*doop_udata_free_callback)(struct doops_loop *loop, void *ptr);
+typedef void *(*doop_malloc_callback)(void *arena, size_t size);
+typedef void *(*doop_realloc_callback)(void *arena, void *ptr, size_t size);
+typedef void (*doop_free_callback)(void *arena, void *ptr);
 
 #ifdef WITH_BLOCKS
     typedef int (^doop_callback_block)(struct doops_loop *loop);
     typedef void (^doop_io_callback_block)(struct doops_loop *loop, int fd);
 #endif
 
+// C++ callables up to DOOPS_EVENT_STORAGE bytes are stored in the event, larger ones are allocated
+#ifndef DOOPS_EVENT_STORAGE
+    #define DOOPS_EVENT_STORAGE (4 * sizeof(void *))
+#endif
+
 struct doops_event {
     doop_callback event_callback;
 #ifdef WITH_BLOCKS
@@ -227,14 +340,207 @@ struct doops_event {
 #endif
     uint64_t when;
     uint64_t interval;
+    uint64_t seq;
+    // the timer may fire up to slack us late, so it can share a wake up with the timers around it
+    uint64_t slack;
+    // 0 when free, checked by timer handles
+    uint64_t id;
     void *user_data;
+    unsigned int heap_index;
+    unsigned int flags;
+    struct doops_event *prev;
     struct doops_event *next;
+    // destroys the callable in storage, called when the event is released
+    void (*storage_free)(struct doops_loop *loop, struct doops_event *ev);
+    union {
+        void *ptr;
+        uint64_t align_u64;
+        double align_double;
+        unsigned char bytes[DOOPS_EVENT_STORAGE];
+    } storage;
+};
+
+// opaque handle returned by loop_add_timer, stays safe to use after the event expires
+struct doops_timer {
+    struct doops_loop *loop;
+    struct doops_event *event;
+    uint64_t id;
+};
+
+#ifndef DOOPS_EVENT_SLAB
+    #define DOOPS_EVENT_SLAB    64
+#endif
+
+// events are carved from slabs and never returned to the allocator before loop_deinit
+struct doops_event_slab {
+    struct doops_event_slab *next;
+    struct doops_event events[DOOPS_EVENT_SLAB];
+};
+
+// coroutine frames (C++) are recycled in power of two size classes, starting at DOOPS_FRAME_MIN bytes
+#ifndef DOOPS_FRAME_MIN
+    #define DOOPS_FRAME_MIN     64
+#endif
+#define DOOPS_FRAME_CLASSES 7
+
+// per-loop allocator, all callbacks receive arena
+struct doops_allocator {
+    doop_malloc_callback malloc_cb;
+    doop_realloc_callback realloc_cb;
+    doop_free_callback free_cb;
+    void *arena;
+};
+
+#ifndef DOOPS_STATS_BUCKETS
+    #define DOOPS_STATS_BUCKETS 24
+#endif
+
+typedef void (*doop_any_callback)(void);
+
+// loop_stats snapshot, only collected when compiled with DOOPS_STATS
+// histograms are log2-bucketed: bucket 0 counts values of 0, bucket i values in [2^(i-1), 2^i), the last bucket everything above
+struct doops_stats {
+    uint64_t iterations;
+    uint64_t waits;
+    uint64_t timers_fired;
+    uint64_t tasks_run;
+    uint64_t deferred_run;
+    uint64_t io_events;
+    // most I/O callbacks dispatched by a single wait
+    uint64_t max_io_events;
+    // total time spent in callbacks and blocked in the wait, in microseconds
+    uint64_t callback_us;
+    uint64_t wait_us;
+    // slowest callback so far, slowest_fd is -1 for timers and posted tasks
+    doop_any_callback slowest_callback;
+    uint64_t slowest_callback_us;
+    int slowest_fd;
+    // current values
+    unsigned int pending_timers;
+    unsigned int io_objects;
+    // callback run time (us)
+    uint64_t callback_hist[DOOPS_STATS_BUCKETS];
+    // timer start time minus its deadline (us)
+    uint64_t timer_late_hist[DOOPS_STATS_BUCKETS];
+    // time blocked in the wait call (us)
+    uint64_t wait_hist[DOOPS_STATS_BUCKETS];
+    // I/O callbacks per wait
+    uint64_t io_events_hist[DOOPS_STATS_BUCKETS];
+};
+
+// per-fd state, indexed by fd
+#define DOOPS_IO_READ       0x01
+#define DOOPS_IO_WRITE      0x02
+#define DOOPS_IO_INTEREST   (DOOPS_IO_READ | DOOPS_IO_WRITE)
+#define DOOPS_IO_REGISTERED 0x04
+#define DOOPS_IO_EXCLUSIVE  0x08
+
+struct doops_fd {
+    doop_io_callback on_read;
+    doop_io_callback on_write;
+    void *user_data;
+    // suspended coroutines (C++) waiting for the fd
+    void *read_waiter;
+    void *write_waiter;
+    // events holding the C++ callables set with loop.on_read/loop.on_write
+    struct doops_event *read_event;
+    struct doops_event *write_event;
+    // DOOPS_IO_* flags, the read/write interest currently set in the kernel
+    unsigned char interest;
+#ifdef WITH_POLL
+    // 1-based index in loop->fds, 0 if not registered
+    int poll_slot;
+#endif
+#ifdef WITH_IO_URING
+    // incremented for every poll request
+    unsigned char uring_gen;
+    // interest of the poll request in the kernel
+    unsigned char uring_armed;
+    unsigned char uring_dirty;
+#endif
+    // loop_set_io_timeout: deadline in wheel ticks, timeout in ms (0 when not set), 1-based wheel slot and fd + 1 links
+    uint64_t idle_deadline;
+    unsigned int idle_timeout;
+    unsigned int idle_slot;
+    int idle_prev;
+    int idle_next;
+};
+
+struct doops_task {
+    doop_callback callback;
+    void *user_data;
+    struct doops_task *next;
+};
+
+// loop_defer queue entry
+struct doops_deferred {
+    doop_callback callback;
+    void *user_data;
+};
+
+#ifndef DOOPS_DEFER_MIN
+    #define DOOPS_DEFER_MIN     64
+#endif
+
+// idle timeout wheel: DOOPS_IDLE_SLOTS slots of DOOPS_IDLE_RESOLUTION ms, longer timeouts take more than one turn
+#ifndef DOOPS_IDLE_RESOLUTION
+    #define DOOPS_IDLE_RESOLUTION   100
+#endif
+#ifndef DOOPS_IDLE_SLOTS
+    #define DOOPS_IDLE_SLOTS        512
+#endif
+
+typedef int (*doop_work_callback)(void *data);
+typedef void (*doop_work_done_callback)(struct doops_loop *loop, int result, void *data);
+
+struct doops_offload;
+
+#ifdef WITH_IO_URING
+typedef void (*doop_uring_callback)(struct doops_loop *loop, int fd, int result, void *data);
+
+struct doops_uring {
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned int sq_entries;
+    unsigned int sqe_tail;
+    unsigned int queued;
+    unsigned int features;
+    struct __kernel_timespec timeout;
+};
+
+struct doops_uring_op {
+    doop_uring_callback callback;
+    void *data;
+    void *buffer;
+    unsigned int len;
+    int fd;
+    unsigned char opcode;
+    unsigned char multishot;
 };
+#endif
 
 struct doops_loop {
     int quit;
     doop_idle_callback idle;
     struct doops_event *events;
+    // binary min-heap ordered by (when, seq)
+    struct doops_event **timers;
+    unsigned int timers_count;
+    unsigned int timers_size;
+    uint64_t timers_seq;
+    uint64_t timers_id;
     doop_io_callback io_read;
     doop_io_callback io_write;
     doop_udata_free_callback udata_free;
@@ -242,14 +548,35 @@ struct doops_loop {
     doop_io_callback_block io_read_block;
     doop_io_callback_block io_write_block;
 #endif
-#if defined(WITH_EPOLL) || defined(WITH_KQUEUE)
+#if defined(WITH_EPOLL) || defined(WITH_KQUEUE) || defined(WITH_IO_URING)
     int poll_fd;
-    int max_fd;
-    void **udata;
+#ifdef WITH_EPOLL
+    int timer_fd;
+    struct epoll_event *wait_events;
+#endif
+#ifdef WITH_KQUEUE
+    struct kevent *wait_events;
+#endif
+#if defined(WITH_EPOLL) || defined(WITH_KQUEUE)
+    int wait_events_size;
+    int wait_events_max;
+    int wait_small_batches;
+    // wait_events[wait_next..wait_count) were left for the next iteration by the budget
+    int wait_next;
+    int wait_count;
+#endif
+#ifdef WITH_IO_URING
+    struct doops_uring ring;
+    // fds whose poll request must be updated before the next io_uring_enter
+    int *uring_dirty;
+    int uring_dirty_count;
+    int uring_dirty_size;
+#endif
 #else
 #ifdef WITH_POLL
     struct pollfd *fds;
     int max_fd;
+    int fds_size;
 #else
     int max_fd;
     // fallback to select
@@ -257,21 +584,292 @@ struct doops_loop {
     fd_set outlist;
     fd_set exceptlist;
 #endif
-    void **udata;
 #endif
     DOOPS_SPINLOCK_TYPE lock;
     int event_fd;
     unsigned int io_objects;
     void *event_data;
     struct doops_event *in_event;
+#ifndef DOOPS_NO_THREADS
+    // thread running the timer callbacks, only it may skip the lock while in_event is set
+    uintptr_t loop_thread;
+#endif
     unsigned char reset_in_event;
     unsigned char io_wait;
+    // lock-free stack of tasks posted by other threads
+    struct doops_task *volatile tasks;
+    // ring of callbacks queued by loop_defer, deferred_size is a power of two
+    struct doops_deferred *deferred;
+    unsigned int deferred_head;
+    unsigned int deferred_count;
+    unsigned int deferred_size;
+    // eventfd (or pipe read end) used to interrupt the wait
+    int wakeup_fd;
+    int wakeup_write_fd;
+    volatile unsigned char sleeping;
+    struct doops_fd *fd_table;
+    int fd_table_size;
+    struct doops_allocator allocator;
+    // recycled events, the most recently freed is reused first
+    struct doops_event *free_events;
+    struct doops_event_slab *slabs;
+    // worker pool started by the first loop_offload, and the jobs whose done callback didn't run yet
+    struct doops_offload *offload;
+    unsigned int offload_pending;
+    // loop_on_signal callbacks indexed by signal number, delivered by signal_fd (signalfd or self-pipe)
+    doop_signal_callback *signal_callbacks;
+    int signal_fd;
+    // idle timeouts: DOOPS_IDLE_SLOTS lists of fd + 1 and the list being expired, the last expired tick and the tick of the wheel timer
+    int *idle_wheel;
+    unsigned int idle_count;
+    uint64_t idle_tick;
+    uint64_t idle_wake;
+    struct doops_timer idle_timer;
+    doop_io_callback idle_callback;
+    // free coroutine frames by size class, the first word links them
+    void *frames[DOOPS_FRAME_CLASSES];
+    // per-iteration budgets set by loop_set_budget, 0 is unlimited
+    unsigned int budget_callbacks;
+    unsigned int budget_us;
+    unsigned int budget_fd_events;
+    // where the next poll/select dispatch starts after one stopped by the budget (slot or fd + 1)
+    int io_resume;
+    // busy polling, set by loop_set_busy_poll
+    int spin_us;
+    int busy_poll_us;
+    uint64_t spin_time;
+    uint64_t sleep_time;
+    uint64_t spin_hits;
+    // set by loop_set_tickless, waits for the next deadline or I/O instead of waking every DOOPS_MAX_SLEEP ms
+    unsigned char tickless;
+    // slack given to new timers, and the deadline the loop is waiting for (0 when none)
+    uint64_t timer_slack;
+    uint64_t wake_at;
+#ifdef DOOPS_STATS
+    struct doops_stats stats;
+#endif
+#ifdef DOOPS_COROUTINES
+    doops::io_awaiter readable(int fd);
+    doops::io_awaiter writable(int fd);
+    doops::sleep_awaiter sleep(int64_t interval);
+    doops::sleep_awaiter sleep_us(int64_t interval_us);
+#endif
+#ifdef DOOPS_FUNCTORS
+    template <typename F> struct doops_timer schedule(F &&callback, int64_t interval);
+    template <typename F> struct doops_timer schedule_us(F &&callback, int64_t interval_us);
+    template <typename F> int on_read(int fd, F &&callback);
+    template <typename F> int on_write(int fd, F &&callback);
+#endif
 };
 
+#ifdef WITH_IO_URING
+// poll registrations carry the fd and its poll generation in user_data, completion requests a struct doops_uring_op pointer
+#define DOOPS_URING_POLL    1
+#define DOOPS_URING_IGNORE  2
+// set in uring_armed, forces the poll request to be replaced
+#define DOOPS_URING_STALE   0x80
+#define DOOPS_URING_POLL_DATA(fd, gen)  (((uint64_t)(fd) << 10) | ((uint64_t)(gen) << 2) | DOOPS_URING_POLL)
+
+static int _private_uring_setup(struct doops_loop *loop) {
+    struct doops_uring *ring = &loop->ring;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(struct io_uring_params));
+    int fd = (int)syscall(__NR_io_uring_setup, DOOPS_MAX_EVENTS, &params);
+    if (fd < 0)
+        return -1;
+
+    memset(ring, 0, sizeof(struct doops_uring));
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, DOOPS_URING_MMAP, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, DOOPS_URING_MMAP, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, DOOPS_URING_MMAP, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(fd);
+        return -1;
+    }
+    unsigned char *sq = (unsigned char *)ring->sq_ring;
+    unsigned char *cq = (unsigned char *)ring->cq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->features = params.features;
+    loop->poll_fd = fd;
+    return 0;
+}
+
+static void _private_uring_close(struct doops_loop *loop) {
+    struct doops_uring *ring = &loop->ring;
+    if (loop->poll_fd <= 0)
+        return;
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    memset(ring, 0, sizeof(struct doops_uring));
+}
+
+// submits every queued request; waits for at least wait_nr completions or timeout_us (-1 = no timeout)
+static int _private_uring_enter(struct doops_loop *loop, unsigned int wait_nr, int timeout_us) {
+    struct doops_uring *ring = &loop->ring;
+    struct io_uring_getevents_arg arg;
+    unsigned int flags = 0;
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    if (wait_nr) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_us >= 0) {
+            ring->timeout.tv_sec = timeout_us / 1000000;
+            ring->timeout.tv_nsec = (timeout_us % 1000000) * 1000;
+            if (ring->features & IORING_FEAT_EXT_ARG) {
+                memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+                arg.ts = (uint64_t)(uintptr_t)&ring->timeout;
+                argp = &arg;
+                argsz = sizeof(struct io_uring_getevents_arg);
+                flags |= IORING_ENTER_EXT_ARG;
+            } else
+            if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) < ring->sq_entries) {
+                // older kernels: a timeout request that completes after the first event
+                struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+                memset(sqe, 0, sizeof(struct io_uring_sqe));
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (uint64_t)(uintptr_t)&ring->timeout;
+                sqe->len = 1;
+                sqe->off = 1;
+                sqe->user_data = DOOPS_URING_IGNORE;
+                ring->sq_array[ring->sqe_tail & *ring->sq_mask] = ring->sqe_tail & *ring->sq_mask;
+                ring->sqe_tail ++;
+                ring->queued ++;
+            }
+        }
+    }
+    if ((!ring->queued) && (!wait_nr))
+        return 0;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    int err = (int)syscall(__NR_io_uring_enter, loop->poll_fd, ring->queued, wait_nr, flags, argp, argsz);
+    if (err > 0) {
+        if ((unsigned int)err >= ring->queued)
+            ring->queued = 0;
+        else
+            ring->queued -= err;
+    }
+    return err;
+}
+
+static struct io_uring_sqe *_private_uring_sqe(struct doops_loop *loop) {
+    struct doops_uring *ring = &loop->ring;
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        // submission queue is full, flush it
+        _private_uring_enter(loop, 0, -1);
+        if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+    unsigned int index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail ++;
+    ring->queued ++;
+    return sqe;
+}
+
+static int _private_uring_poll(struct doops_loop *loop, int fd, unsigned int events) {
+    struct io_uring_sqe *sqe = _private_uring_sqe(loop);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    events = (events << 16) | (events >> 16);
+#endif
+    sqe->poll32_events = events;
+    // multishot, edge-triggered like the epoll registration
+    sqe->len = IORING_POLL_ADD_MULTI;
+    // completions of the previous poll request (already removed) are recognized and dropped
+    loop->fd_table[fd].uring_gen ++;
+    sqe->user_data = DOOPS_URING_POLL_DATA(fd, loop->fd_table[fd].uring_gen);
+    return 0;
+}
+
+static int _private_uring_poll_remove(struct doops_loop *loop, int fd) {
+    struct io_uring_sqe *sqe = _private_uring_sqe(loop);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = DOOPS_URING_POLL_DATA(fd, loop->fd_table[fd].uring_gen);
+    sqe->user_data = DOOPS_URING_IGNORE;
+    return 0;
+}
+
+static int _private_uring_submit_op(struct doops_loop *loop, struct doops_uring_op *op) {
+    struct io_uring_sqe *sqe = _private_uring_sqe(loop);
+    if (!sqe)
+        return -1;
+    sqe->opcode = op->opcode;
+    sqe->fd = op->fd;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    switch (op->opcode) {
+        case IORING_OP_ACCEPT:
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+#ifdef IORING_ACCEPT_MULTISHOT
+            if (op->multishot)
+                sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+#endif
+            break;
+        default:
+            sqe->addr = (uint64_t)(uintptr_t)op->buffer;
+            sqe->len = op->len;
+            // current file position, ignored by sockets
+            sqe->off = (uint64_t)-1;
+            break;
+    }
+    return 0;
+}
+
+#endif
+
 static void _private_loop_init_io(struct doops_loop *loop) {
     if (!loop)
         return;
 
+#ifdef WITH_IO_URING
+    if (loop->poll_fd <= 0)
+        _private_uring_setup(loop);
+#else
 #ifdef WITH_EPOLL
     if (loop->poll_fd <= 0)
         loop->poll_fd = epoll_create1(0);
@@ -281,8 +879,9 @@ static void _private_loop_init_io(struct doops_loop *loop) {
         loop->poll_fd = kqueue();
 #else
 #ifdef WITH_POLL
-    if (!loop->max_fd) {
+    if (!loop->fds_size) {
         loop->fds = NULL;
+        loop->max_fd = 0;
     }
 #else
     if (!loop->max_fd) {
@@ -294,14 +893,44 @@ static void _private_loop_init_io(struct doops_loop *loop) {
 #endif
 #endif
 #endif
+#endif
 }
 
-static uint64_t milliseconds() {
+static uint64_t microseconds() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    return (uint64_t)(tv.tv_sec) * 1000 + (uint64_t)(tv.tv_usec) / 1000;
+    return (uint64_t)(tv.tv_sec) * 1000000 + (uint64_t)(tv.tv_usec);
+}
+
+static uint64_t milliseconds() {
+    return microseconds() / 1000;
+}
+
+#ifdef DOOPS_STATS
+static void _private_loop_stats_add(uint64_t *hist, uint64_t value) {
+    unsigned int bucket = 0;
+    while ((value) && (bucket < DOOPS_STATS_BUCKETS - 1)) {
+        value >>= 1;
+        bucket ++;
+    }
+    hist[bucket] ++;
 }
 
+// start is the microseconds() value taken before calling back
+static void _private_loop_stats_callback(struct doops_loop *loop, uint64_t *counter, uint64_t start, doop_any_callback callback, int fd) {
+    uint64_t now = microseconds();
+    uint64_t elapsed = (now > start) ? now - start : 0;
+    (*counter) ++;
+    loop->stats.callback_us += elapsed;
+    _private_loop_stats_add(loop->stats.callback_hist, elapsed);
+    if ((elapsed > loop->stats.slowest_callback_us) || ((!loop->stats.slowest_callback_us) && (!loop->stats.slowest_callback))) {
+        loop->stats.slowest_callback_us = elapsed;
+        loop->stats.slowest_callback = callback;
+        loop->stats.slowest_fd = fd;
+    }
+}
+#endif
+
 static void doops_lock(volatile DOOPS_SPINLOCK_TYPE *ptr) {
     if (!ptr)
         return;
@@ -311,7 +940,7 @@ static void doops_lock(volatile DOOPS_SPINLOCK_TYPE *ptr) {
     }
 #else
     while (__sync_lock_test_and_set(ptr, 1))
-        while (*ptr);
+        while (__atomic_load_n(ptr, __ATOMIC_RELAXED));
 #endif
 }
 
@@ -325,111 +954,638 @@ static void doops_unlock(volatile DOOPS_SPINLOCK_TYPE *ptr) {
 #endif
 }
 
-static void loop_init(struct doops_loop *loop) {
-    if (loop) {
-        memset(loop, 0, sizeof(struct doops_loop));
-        loop->io_wait = 1;
-    }
+// tasks is pushed by other threads
+static struct doops_task *_private_loop_peek_tasks(struct doops_loop *loop) {
+#ifdef _WIN32
+    return (struct doops_task *)InterlockedCompareExchangePointer((PVOID volatile *)&loop->tasks, NULL, NULL);
+#else
+    return __atomic_load_n(&loop->tasks, __ATOMIC_RELAXED);
+#endif
 }
 
-static struct doops_loop *loop_new() {
-    struct doops_loop *loop = (struct doops_loop *)DOOPS_MALLOC(sizeof(struct doops_loop));
-    if (loop)
-        loop_init(loop);
-    return loop;
+static struct doops_task *_private_loop_push_task(struct doops_loop *loop, struct doops_task *task) {
+    struct doops_task *head;
+    do {
+        head = _private_loop_peek_tasks(loop);
+        task->next = head;
+#ifdef _WIN32
+    } while (InterlockedCompareExchangePointer((PVOID volatile *)&loop->tasks, task, head) != head);
+#else
+    } while (__sync_val_compare_and_swap(&loop->tasks, head, task) != head);
+#endif
+    return head;
 }
 
-static int loop_add(struct doops_loop *loop, doop_callback callback, int64_t interval, void *user_data) {
-    if ((!callback) || (!loop)) {
-        errno = EINVAL;
-        return -1;
-    }
+static struct doops_task *_private_loop_take_tasks(struct doops_loop *loop) {
+    if (!_private_loop_peek_tasks(loop))
+        return NULL;
+#ifdef _WIN32
+    return (struct doops_task *)InterlockedExchangePointer((PVOID volatile *)&loop->tasks, NULL);
+#else
+    return __sync_lock_test_and_set(&loop->tasks, (struct doops_task *)NULL);
+#endif
+}
 
-    struct doops_event *event_callback = (struct doops_event *)DOOPS_MALLOC(sizeof(struct doops_event));
-    if (!event_callback) {
-        errno = ENOMEM;
-        return -1;
-    }
+#ifndef DOOPS_NO_THREADS
+static uintptr_t _private_loop_thread_id() {
+#ifdef _WIN32
+    return (uintptr_t)GetCurrentThreadId();
+#else
+    return (uintptr_t)pthread_self();
+#endif
+}
+#endif
 
-    if (!loop->in_event)
-        doops_lock(&loop->lock);
-    event_callback->event_callback = callback;
-#ifdef WITH_BLOCKS
-    event_callback->event_block = NULL;
+// the loop thread holds the lock while a timer callback runs, other threads must always take it
+static int _private_loop_in_callback(struct doops_loop *loop) {
+#ifndef DOOPS_NO_THREADS
+#ifdef _WIN32
+    if ((uintptr_t)InterlockedCompareExchangePointer((PVOID volatile *)&loop->loop_thread, NULL, NULL) != _private_loop_thread_id())
+        return 0;
+#else
+    if (__atomic_load_n(&loop->loop_thread, __ATOMIC_RELAXED) != _private_loop_thread_id())
+        return 0;
 #endif
-    if (interval < 0)
-        event_callback->interval = (uint64_t)(-interval);
-    else
-        event_callback->interval = (uint64_t)interval;
-    event_callback->when = milliseconds() + interval;
-    event_callback->user_data = user_data;
-    event_callback->next = loop->events;
+#endif
+    return loop->in_event != NULL;
+}
+
+static void loop_wakeup(struct doops_loop *loop) {
+    if ((!loop) || (loop->wakeup_write_fd <= 0))
+        return;
+#if defined(WITH_EPOLL) || defined(WITH_IO_URING)
+    uint64_t value = 1;
+#else
+    unsigned char value = 1;
+#endif
+    // a full pipe or eventfd is already signaled
+    if (write(loop->wakeup_write_fd, &value, sizeof(value)) < 0)
+        return;
+}
+
+static void *_private_loop_malloc(struct doops_loop *loop, size_t size) {
+    if (loop->allocator.malloc_cb)
+        return loop->allocator.malloc_cb(loop->allocator.arena, size);
+    return DOOPS_MALLOC(size);
+}
+
+static void *_private_loop_realloc(struct doops_loop *loop, void *ptr, size_t size) {
+    if (loop->allocator.realloc_cb)
+        return loop->allocator.realloc_cb(loop->allocator.arena, ptr, size);
+    return DOOPS_REALLOC(ptr, size);
+}
 
-    loop->events = event_callback;
-    if (loop->in_event)
-        loop->reset_in_event = 2;
+static void _private_loop_free(struct doops_loop *loop, void *ptr) {
+    if (!ptr)
+        return;
+    if (loop->allocator.free_cb)
+        loop->allocator.free_cb(loop->allocator.arena, ptr);
     else
-        doops_unlock(&loop->lock);
-    return 0;
+        DOOPS_FREE(ptr);
 }
 
-#ifdef WITH_BLOCKS
-static int loop_add_block(struct doops_loop *loop, doop_callback_block callback, int64_t interval, void *user_data) {
-    if ((!callback) || (!loop)) {
-        errno = EINVAL;
-        return -1;
+static int _private_timer_less(const struct doops_event *a, const struct doops_event *b) {
+    if (a->when != b->when)
+        return a->when < b->when;
+    return a->seq < b->seq;
+}
+
+static void _private_timer_swap(struct doops_loop *loop, unsigned int i, unsigned int j) {
+    struct doops_event *ev = loop->timers[i];
+    loop->timers[i] = loop->timers[j];
+    loop->timers[j] = ev;
+    loop->timers[i]->heap_index = i;
+    loop->timers[j]->heap_index = j;
+}
+
+static void _private_timer_sift_up(struct doops_loop *loop, unsigned int index) {
+    while (index) {
+        unsigned int parent = (index - 1) / 2;
+        if (!_private_timer_less(loop->timers[index], loop->timers[parent]))
+            break;
+        _private_timer_swap(loop, index, parent);
+        index = parent;
     }
+}
 
-    struct doops_event *event_callback = (struct doops_event *)DOOPS_MALLOC(sizeof(struct doops_event));
-    if (!event_callback) {
-        errno = ENOMEM;
-        return -1;
+static void _private_timer_sift_down(struct doops_loop *loop, unsigned int index) {
+    while (1) {
+        unsigned int smallest = index;
+        unsigned int left = index * 2 + 1;
+        unsigned int right = left + 1;
+        if ((left < loop->timers_count) && (_private_timer_less(loop->timers[left], loop->timers[smallest])))
+            smallest = left;
+        if ((right < loop->timers_count) && (_private_timer_less(loop->timers[right], loop->timers[smallest])))
+            smallest = right;
+        if (smallest == index)
+            break;
+        _private_timer_swap(loop, index, smallest);
+        index = smallest;
     }
+}
 
-    if (!loop->in_event)
-        doops_lock(&loop->lock);
-    event_callback->event_callback = NULL;
-    event_callback->event_block = Block_copy(callback);
-    if (interval < 0)
-        event_callback->interval = (uint64_t)(-interval);
+static int _private_timer_push(struct doops_loop *loop, struct doops_event *ev) {
+    if (loop->timers_count >= loop->timers_size) {
+        unsigned int timers_size = loop->timers_size ? loop->timers_size * 2 : 16;
+        struct doops_event **timers = (struct doops_event **)_private_loop_realloc(loop, loop->timers, sizeof(struct doops_event *) * timers_size);
+        if (!timers) {
+            errno = ENOMEM;
+            return -1;
+        }
+        loop->timers = timers;
+        loop->timers_size = timers_size;
+    }
+    ev->seq = loop->timers_seq ++;
+    ev->heap_index = loop->timers_count ++;
+    loop->timers[ev->heap_index] = ev;
+    _private_timer_sift_up(loop, ev->heap_index);
+    return 0;
+}
+
+static void _private_timer_remove(struct doops_loop *loop, struct doops_event *ev) {
+    unsigned int index = ev->heap_index;
+    if (index >= loop->timers_count)
+        return;
+    ev->heap_index = DOOPS_TIMER_DETACHED;
+    loop->timers_count --;
+    if (index == loop->timers_count)
+        return;
+    loop->timers[index] = loop->timers[loop->timers_count];
+    loop->timers[index]->heap_index = index;
+    if ((index) && (_private_timer_less(loop->timers[index], loop->timers[(index - 1) / 2])))
+        _private_timer_sift_up(loop, index);
     else
-        event_callback->interval = (uint64_t)interval;
-    event_callback->when = milliseconds() + interval;
-    event_callback->user_data = user_data;
-    event_callback->next = loop->events;
+        _private_timer_sift_down(loop, index);
+}
 
-    loop->events = event_callback;
-    if (loop->in_event)
-        loop->reset_in_event = 2;
+// earliest wake up that honours the slack of every timer due before it, visits only the timers due in that window
+static uint64_t _private_timer_wake(struct doops_loop *loop, unsigned int index, uint64_t wake) {
+    if (index >= loop->timers_count)
+        return wake;
+    struct doops_event *ev = loop->timers[index];
+    // heap order, the children aren't due earlier
+    if (ev->when >= wake)
+        return wake;
+    if (ev->when + ev->slack < wake)
+        wake = ev->when + ev->slack;
+    wake = _private_timer_wake(loop, 2 * index + 1, wake);
+    return _private_timer_wake(loop, 2 * index + 2, wake);
+}
+
+// a timer pushed while the loop waits must interrupt it
+static int _private_timer_wakes(struct doops_loop *loop, struct doops_event *ev) {
+    return (!ev->heap_index) || (ev->when + ev->slack < loop->wake_at);
+}
+
+static void _private_loop_link_event(struct doops_loop *loop, struct doops_event *ev) {
+    ev->prev = NULL;
+    ev->next = loop->events;
+    if (loop->events)
+        loop->events->prev = ev;
+    loop->events = ev;
+}
+
+static void _private_loop_unlink_event(struct doops_loop *loop, struct doops_event *ev) {
+    if (ev->prev)
+        ev->prev->next = ev->next;
     else
-        doops_unlock(&loop->lock);
-    return 0;
+        loop->events = ev->next;
+    if (ev->next)
+        ev->next->prev = ev->prev;
+    ev->prev = NULL;
+    ev->next = NULL;
 }
-#endif
 
-static int loop_add_io_data(struct doops_loop *loop, int fd, int mode, void *userdata) {
-    if ((fd < 0) || (!loop)) {
-        errno = EINVAL;
-        return -1;
+static void _private_loop_free_event(struct doops_loop *loop, struct doops_event *ev) {
+    if ((loop->udata_free) && (ev->user_data) && (!(ev->flags & DOOPS_EVENT_INTERNAL))) {
+        loop->event_data = ev->user_data;
+        loop->udata_free(loop, ev->user_data);
     }
-    int locked = 0;
-    if (!loop->in_event) {
-        doops_lock(&loop->lock);
-        locked = 1;
+    if (ev->storage_free) {
+        ev->storage_free(loop, ev);
+        ev->storage_free = NULL;
+    }
+#ifdef WITH_BLOCKS
+    if (ev->event_block)
+        Block_release(ev->event_block);
+#endif
+    // loop lock is held
+    ev->id = 0;
+    ev->next = loop->free_events;
+    loop->free_events = ev;
+}
+
+static struct doops_event *_private_loop_alloc_event(struct doops_loop *loop) {
+    int locked = 0;
+    if (!_private_loop_in_callback(loop)) {
+        doops_lock(&loop->lock);
+        locked = 1;
+    }
+    if (!loop->free_events) {
+        struct doops_event_slab *slab = (struct doops_event_slab *)_private_loop_malloc(loop, sizeof(struct doops_event_slab));
+        if (slab) {
+            slab->next = loop->slabs;
+            loop->slabs = slab;
+            int i;
+            for (i = DOOPS_EVENT_SLAB - 1; i >= 0; i --) {
+                slab->events[i].next = loop->free_events;
+                loop->free_events = &slab->events[i];
+            }
+        }
+    }
+    struct doops_event *ev = loop->free_events;
+    if (ev) {
+        loop->free_events = ev->next;
+        ev->storage_free = NULL;
+    }
+    if (locked)
+        doops_unlock(&loop->lock);
+    if (!ev)
+        errno = ENOMEM;
+    return ev;
+}
+
+// returns an event that was never scheduled
+static void _private_loop_discard_event(struct doops_loop *loop, struct doops_event *ev) {
+    if (ev->storage_free) {
+        ev->storage_free(loop, ev);
+        ev->storage_free = NULL;
+    }
+    int locked = 0;
+    if (!_private_loop_in_callback(loop)) {
+        doops_lock(&loop->lock);
+        locked = 1;
+    }
+    ev->id = 0;
+    ev->next = loop->free_events;
+    loop->free_events = ev;
+    if (locked)
+        doops_unlock(&loop->lock);
+}
+
+// events holding per-fd callables, never linked or scheduled
+static void _private_loop_release_event(struct doops_loop *loop, struct doops_event *ev) {
+    // released from its own callback
+    if (ev->flags & DOOPS_EVENT_RUNNING) {
+        ev->flags |= DOOPS_EVENT_RELEASED;
+        return;
+    }
+    int locked = 0;
+    if (!_private_loop_in_callback(loop)) {
+        doops_lock(&loop->lock);
+        locked = 1;
+    }
+    _private_loop_free_event(loop, ev);
+    if (locked)
+        doops_unlock(&loop->lock);
+}
+
+static void _private_loop_free_slabs(struct doops_loop *loop) {
+    while (loop->slabs) {
+        struct doops_event_slab *next = loop->slabs->next;
+        _private_loop_free(loop, loop->slabs);
+        loop->slabs = next;
+    }
+    loop->free_events = NULL;
+}
+
+// interval is in microseconds, a negative interval fires immediately, then every -interval
+static void _private_loop_set_deadline(struct doops_event *ev, int64_t interval, unsigned int flags) {
+    if (interval < 0)
+        ev->interval = (uint64_t)(-interval);
+    else
+        ev->interval = (uint64_t)interval;
+    ev->when = microseconds() + interval;
+    ev->flags = flags;
+}
+
+// interval is in microseconds
+static int _private_loop_schedule_event(struct doops_loop *loop, struct doops_event *event_callback, int64_t interval, void *user_data, unsigned int flags, struct doops_timer *timer) {
+    _private_loop_set_deadline(event_callback, interval, flags);
+    event_callback->user_data = user_data;
+    event_callback->slack = loop->timer_slack;
+
+    int locked = 0;
+    if (!_private_loop_in_callback(loop)) {
+        doops_lock(&loop->lock);
+        locked = 1;
+    }
+    int err = _private_timer_push(loop, event_callback);
+    if (!err) {
+        _private_loop_link_event(loop, event_callback);
+        event_callback->id = ++ loop->timers_id;
+        if (timer) {
+            timer->loop = loop;
+            timer->event = event_callback;
+            timer->id = event_callback->id;
+        }
+    }
+    // added from another thread, the loop is waiting for a later deadline
+    if ((!err) && (loop->sleeping) && (_private_timer_wakes(loop, event_callback)))
+        loop_wakeup(loop);
+    if (locked)
+        doops_unlock(&loop->lock);
+    return err;
+}
+
+static void loop_init(struct doops_loop *loop) {
+    if (loop) {
+        memset(loop, 0, sizeof(struct doops_loop));
+        loop->io_wait = 1;
+    }
+}
+
+static struct doops_loop *loop_new() {
+    struct doops_loop *loop = (struct doops_loop *)DOOPS_MALLOC(sizeof(struct doops_loop));
+    if (loop)
+        loop_init(loop);
+    return loop;
+}
+
+// must be called before the loop allocates anything; NULL restores DOOPS_MALLOC/DOOPS_REALLOC/DOOPS_FREE
+static int loop_set_allocator(struct doops_loop *loop, const struct doops_allocator *allocator) {
+    if ((!loop) || ((allocator) && ((!allocator->malloc_cb) || (!allocator->realloc_cb) || (!allocator->free_cb)))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((loop->slabs) || (loop->timers) || (loop->fd_table) || (loop->io_objects) || (loop->deferred) || (loop->idle_wheel)) {
+        errno = EBUSY;
+        return -1;
+    }
+    int i;
+    for (i = 0; i < DOOPS_FRAME_CLASSES; i ++) {
+        if (loop->frames[i]) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+#if defined(WITH_EPOLL) || defined(WITH_KQUEUE)
+    if (loop->wait_events) {
+        errno = EBUSY;
+        return -1;
+    }
+#endif
+    if (allocator)
+        loop->allocator = *allocator;
+    else
+        memset(&loop->allocator, 0, sizeof(struct doops_allocator));
+    return 0;
+}
+
+static int _private_loop_add(struct doops_loop *loop, doop_callback callback, int64_t interval_us, void *user_data, unsigned int flags, struct doops_timer *timer) {
+    if ((!callback) || (!loop)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct doops_event *event_callback = _private_loop_alloc_event(loop);
+    if (!event_callback)
+        return -1;
+
+    event_callback->event_callback = callback;
+#ifdef WITH_BLOCKS
+    event_callback->event_block = NULL;
+#endif
+    if (_private_loop_schedule_event(loop, event_callback, interval_us, user_data, flags, timer)) {
+        _private_loop_discard_event(loop, event_callback);
+        return -1;
+    }
+    return 0;
+}
+
+static int loop_add(struct doops_loop *loop, doop_callback callback, int64_t interval, void *user_data) {
+    return _private_loop_add(loop, callback, interval * 1000, user_data, 0, NULL);
+}
+
+static int loop_add_us(struct doops_loop *loop, doop_callback callback, int64_t interval_us, void *user_data) {
+    return _private_loop_add(loop, callback, interval_us, user_data, DOOPS_EVENT_PRECISE, NULL);
+}
+
+// timer.event is NULL on error
+static struct doops_timer loop_add_timer(struct doops_loop *loop, doop_callback callback, int64_t interval, void *user_data) {
+    struct doops_timer timer;
+    memset(&timer, 0, sizeof(struct doops_timer));
+    _private_loop_add(loop, callback, interval * 1000, user_data, 0, &timer);
+    return timer;
+}
+
+static struct doops_timer _private_loop_add_internal(struct doops_loop *loop, doop_callback callback, int64_t interval, void *data) {
+    struct doops_timer timer;
+    memset(&timer, 0, sizeof(struct doops_timer));
+    _private_loop_add(loop, callback, interval * 1000, data, DOOPS_EVENT_INTERNAL, &timer);
+    return timer;
+}
+
+static struct doops_timer loop_add_timer_us(struct doops_loop *loop, doop_callback callback, int64_t interval_us, void *user_data) {
+    struct doops_timer timer;
+    memset(&timer, 0, sizeof(struct doops_timer));
+    _private_loop_add(loop, callback, interval_us, user_data, DOOPS_EVENT_PRECISE, &timer);
+    return timer;
+}
+
+#ifdef WITH_BLOCKS
+static int _private_loop_add_block(struct doops_loop *loop, doop_callback_block callback, int64_t interval_us, void *user_data, unsigned int flags, struct doops_timer *timer) {
+    if ((!callback) || (!loop)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct doops_event *event_callback = _private_loop_alloc_event(loop);
+    if (!event_callback)
+        return -1;
+
+    event_callback->event_callback = NULL;
+    event_callback->event_block = Block_copy(callback);
+    if (_private_loop_schedule_event(loop, event_callback, interval_us, user_data, flags, timer)) {
+        Block_release(event_callback->event_block);
+        _private_loop_discard_event(loop, event_callback);
+        return -1;
+    }
+    return 0;
+}
+
+static int loop_add_block(struct doops_loop *loop, doop_callback_block callback, int64_t interval, void *user_data) {
+    return _private_loop_add_block(loop, callback, interval * 1000, user_data, 0, NULL);
+}
+
+static int loop_add_block_us(struct doops_loop *loop, doop_callback_block callback, int64_t interval_us, void *user_data) {
+    return _private_loop_add_block(loop, callback, interval_us, user_data, DOOPS_EVENT_PRECISE, NULL);
+}
+
+static struct doops_timer loop_add_block_timer(struct doops_loop *loop, doop_callback_block callback, int64_t interval, void *user_data) {
+    struct doops_timer timer;
+    memset(&timer, 0, sizeof(struct doops_timer));
+    _private_loop_add_block(loop, callback, interval * 1000, user_data, 0, &timer);
+    return timer;
+}
+
+static struct doops_timer loop_add_block_timer_us(struct doops_loop *loop, doop_callback_block callback, int64_t interval_us, void *user_data) {
+    struct doops_timer timer;
+    memset(&timer, 0, sizeof(struct doops_timer));
+    _private_loop_add_block(loop, callback, interval_us, user_data, DOOPS_EVENT_PRECISE, &timer);
+    return timer;
+}
+#endif
+
+static int _private_loop_fd_table(struct doops_loop *loop, int fd) {
+    if (fd < loop->fd_table_size)
+        return 0;
+    int size = loop->fd_table_size ? loop->fd_table_size : 64;
+    while (size <= fd)
+        size *= 2;
+    struct doops_fd *fd_table = (struct doops_fd *)_private_loop_realloc(loop, loop->fd_table, sizeof(struct doops_fd) * size);
+    if (!fd_table) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(fd_table + loop->fd_table_size, 0, sizeof(struct doops_fd) * (size - loop->fd_table_size));
+    loop->fd_table = fd_table;
+    loop->fd_table_size = size;
+    return 0;
+}
+
+static void _private_loop_release_fd_events(struct doops_loop *loop, int fd) {
+    struct doops_event *ev = loop->fd_table[fd].read_event;
+    if (ev) {
+        loop->fd_table[fd].read_event = NULL;
+        _private_loop_release_event(loop, ev);
+    }
+    ev = loop->fd_table[fd].write_event;
+    if (ev) {
+        loop->fd_table[fd].write_event = NULL;
+        _private_loop_release_event(loop, ev);
+    }
+}
+
+#ifdef WITH_EPOLL
+static unsigned int _private_epoll_events(unsigned char interest) {
+    unsigned int events = EPOLLHUP | EPOLLET;
+    if (interest & DOOPS_IO_READ)
+        events |= EPOLLIN | EPOLLPRI | EPOLLRDHUP;
+    if (interest & DOOPS_IO_WRITE)
+        events |= EPOLLOUT;
+    return events;
+}
+#endif
+
+#if defined(WITH_POLL) || defined(WITH_IO_URING)
+static unsigned int _private_poll_events(unsigned char interest) {
+    unsigned int events = POLLERR | POLLHUP | POLLNVAL;
+    if (interest & DOOPS_IO_READ)
+        events |= POLLIN | POLLPRI;
+    if (interest & DOOPS_IO_WRITE)
+        events |= POLLOUT;
+    return events;
+}
+#endif
+
+#ifdef WITH_IO_URING
+// poll changes are applied in batch: a request cannot be reliably removed in the submission that added it
+static int _private_uring_mark(struct doops_loop *loop, int fd) {
+    if (loop->fd_table[fd].uring_dirty)
+        return 0;
+    if (loop->uring_dirty_count >= loop->uring_dirty_size) {
+        int size = loop->uring_dirty_size ? loop->uring_dirty_size * 2 : 16;
+        int *dirty = (int *)_private_loop_realloc(loop, loop->uring_dirty, sizeof(int) * size);
+        if (!dirty) {
+            errno = ENOMEM;
+            return -1;
+        }
+        loop->uring_dirty = dirty;
+        loop->uring_dirty_size = size;
+    }
+    loop->uring_dirty[loop->uring_dirty_count ++] = fd;
+    loop->fd_table[fd].uring_dirty = 1;
+    return 0;
+}
+
+static void _private_uring_flush_polls(struct doops_loop *loop) {
+    int i;
+    for (i = 0; i < loop->uring_dirty_count; i ++) {
+        int fd = loop->uring_dirty[i];
+        struct doops_fd *fd_state = &loop->fd_table[fd];
+        unsigned char interest = fd_state->interest & DOOPS_IO_INTEREST;
+        fd_state->uring_dirty = 0;
+        if (fd_state->uring_armed == interest)
+            continue;
+        if ((fd_state->uring_armed) && (_private_uring_poll_remove(loop, fd)))
+            continue;
+        fd_state->uring_armed = 0;
+        if ((interest) && (!_private_uring_poll(loop, fd, _private_poll_events(interest))))
+            fd_state->uring_armed = interest;
+    }
+    loop->uring_dirty_count = 0;
+}
+#endif
+
+// not a socket or not supported: ignored
+static void _private_loop_busy_poll_fd(int fd, int busy_poll_us) {
+#ifdef SO_BUSY_POLL
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, (const char *)&busy_poll_us, sizeof(int));
+#else
+    (void)fd;
+    (void)busy_poll_us;
+#endif
+}
+
+// exclusive: fd is shared between multiple loops, wake only one of them
+static int _private_loop_add_io_data(struct doops_loop *loop, int fd, int mode, void *userdata, int exclusive) {
+    if ((fd < 0) || (!loop)) {
+        errno = EINVAL;
+        return -1;
+    }
+#if !defined(_WIN32) && !defined(WITH_EPOLL) && !defined(WITH_KQUEUE) && !defined(WITH_POLL) && !defined(WITH_IO_URING)
+    // fd_set cannot hold it
+    if (fd >= FD_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+#endif
+    int locked = 0;
+    if (!_private_loop_in_callback(loop)) {
+        doops_lock(&loop->lock);
+        locked = 1;
     }
     _private_loop_init_io(loop);
+    if (_private_loop_fd_table(loop, fd)) {
+        if (locked)
+            doops_unlock(&loop->lock);
+        return -1;
+    }
+    unsigned char previous = loop->fd_table[fd].interest;
+    unsigned char interest = DOOPS_IO_READ;
+    if (mode) {
+        interest |= DOOPS_IO_WRITE;
+        // write-only
+        if (mode == 2)
+            interest &= ~DOOPS_IO_READ;
+    }
+#ifdef WITH_IO_URING
+    if (loop->poll_fd <= 0) {
+        if (locked)
+            doops_unlock(&loop->lock);
+        return -1;
+    }
+    // the fd number was reused before the previous poll request was removed, that request still watches the closed file
+    if ((!(previous & DOOPS_IO_REGISTERED)) && (loop->fd_table[fd].uring_armed))
+        loop->fd_table[fd].uring_armed |= DOOPS_URING_STALE;
+    if (_private_uring_mark(loop, fd)) {
+        if (locked)
+            doops_unlock(&loop->lock);
+        return -1;
+    }
+#else
 #ifdef WITH_EPOLL
     struct epoll_event event;
     // supress valgrind warning
     event.data.u64 = 0;
     event.data.fd = fd;
-    event.events = EPOLLIN | EPOLLPRI | EPOLLHUP | EPOLLRDHUP | EPOLLET;
-    if (mode) {
-        event.events |= EPOLLOUT;
-        // write-only
-        if (mode == 2)
-            event.events &= ~(EPOLLIN | EPOLLRDHUP);
-    }
+    event.events = _private_epoll_events(interest);
+#ifdef EPOLLEXCLUSIVE
+    // EPOLLEXCLUSIVE doesn't accept EPOLLPRI/EPOLLRDHUP; level-triggered, so a wake up is not lost to another loop
+    if (exclusive)
+        event.events = (event.events & (EPOLLIN | EPOLLOUT)) | EPOLLEXCLUSIVE;
+#endif
 
     int err = epoll_ctl (loop->poll_fd, EPOLL_CTL_ADD, fd, &event);
     if ((err) && (errno == EEXIST))
@@ -439,154 +1595,249 @@ static int loop_add_io_data(struct doops_loop *loop, int fd, int mode, void *use
             doops_unlock(&loop->lock);
         return -1;
     }
-    if ((userdata) || (loop->udata)) {
-        if (fd >= loop->max_fd) {
-            loop->max_fd = fd + 1;
-            loop->udata = DOOPS_REALLOC(loop->udata, sizeof(void *) * loop->max_fd);
-        }
-        if (loop->udata)
-            loop->udata[fd] = userdata;
-    }
 #else
 #ifdef WITH_KQUEUE
     struct kevent events[2];
     int num_events = 0;
-    if (mode != 2) {
+    if (interest & DOOPS_IO_READ) {
         EV_SET(&events[0], fd, EVFILT_READ, EV_ADD | EV_ENABLE | EV_CLEAR, 0, 0, 0);
         events[0].udata = userdata;
         num_events ++;
+    } else
+    if (previous & DOOPS_IO_READ) {
+        EV_SET(&events[0], fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+        num_events ++;
     }
 
-    if (mode) {
+    if (interest & DOOPS_IO_WRITE) {
         EV_SET(&events[num_events], fd, EVFILT_WRITE, EV_ADD | EV_ENABLE | EV_CLEAR, 0, 0, 0);
         events[num_events].udata = userdata;
         num_events ++;
+    } else
+    if (previous & DOOPS_IO_WRITE) {
+        EV_SET(&events[num_events], fd, EVFILT_WRITE, EV_DELETE, 0, 0, 0);
+        num_events ++;
+    }
+    if (kevent(loop->poll_fd, events, num_events, NULL, 0, NULL)) {
+        if (locked)
+            doops_unlock(&loop->lock);
+        return -1;
     }
-    if (locked)
-        doops_unlock(&loop->lock);
-    return kevent(loop->poll_fd, events, num_events, NULL, 0, NULL);
 #else
 #ifdef WITH_POLL
-    loop->fds = (struct pollfd *)DOOPS_REALLOC(loop->fds, sizeof(struct pollfd) * (loop->max_fd + 1));
-    loop->fds[loop->max_fd].fd = fd;
-    loop->fds[loop->max_fd].events = POLLIN | POLLPRI | POLLERR | POLLHUP | POLLNVAL;
-    if (mode) {
-        loop->fds[loop->max_fd].events |= POLLOUT;
-        // write-only
-        if (mode == 2)
-            loop->fds[loop->max_fd].events &= ~POLLIN;
-    }
-
-    if ((userdata) || (loop->udata)) {
-        loop->udata = (void **)DOOPS_REALLOC(loop->udata, sizeof(void *) * (loop->max_fd + 1));
-        if (loop->udata)
-            loop->udata[loop->max_fd] = userdata;
+    int slot = loop->fd_table[fd].poll_slot - 1;
+    if (slot < 0) {
+        if (loop->max_fd >= loop->fds_size) {
+            int fds_size = loop->fds_size ? loop->fds_size * 2 : 16;
+            struct pollfd *fds = (struct pollfd *)_private_loop_realloc(loop, loop->fds, sizeof(struct pollfd) * fds_size);
+            if (!fds) {
+                if (locked)
+                    doops_unlock(&loop->lock);
+                errno = ENOMEM;
+                return -1;
+            }
+            loop->fds = fds;
+            loop->fds_size = fds_size;
+        }
+        slot = loop->max_fd ++;
+        loop->fd_table[fd].poll_slot = slot + 1;
     }
-    loop->max_fd ++;
+    loop->fds[slot].fd = fd;
+    loop->fds[slot].events = (short)_private_poll_events(interest);
+    loop->fds[slot].revents = 0;
 #else
-    if (mode != 2)
+    if (interest & DOOPS_IO_READ)
         FD_SET(fd, &loop->inlist);
+    else
+        FD_CLR(fd, &loop->inlist);
     FD_SET(fd, &loop->exceptlist);
-    if (mode)
+    if (interest & DOOPS_IO_WRITE)
         FD_SET(fd, &loop->outlist);
+    else
+        FD_CLR(fd, &loop->outlist);
 
     if (fd >= loop->max_fd)
         loop->max_fd = fd + 1;
-    if ((userdata) || (loop->udata)) {
-        loop->udata = (void **)DOOPS_REALLOC(loop->udata, sizeof(void *) * loop->max_fd);
-        if (loop->udata)
-            loop->udata[fd] = userdata;
-    }
 #endif
 #endif
 #endif
-    loop->io_objects ++;
+#endif
+    loop->fd_table[fd].user_data = userdata;
+    loop->fd_table[fd].interest = interest | DOOPS_IO_REGISTERED;
+    if (exclusive)
+        loop->fd_table[fd].interest |= DOOPS_IO_EXCLUSIVE;
+    // re-registering an fd only changes its interest
+    if (!(previous & DOOPS_IO_REGISTERED)) {
+        loop->io_objects ++;
+        if (loop->busy_poll_us)
+            _private_loop_busy_poll_fd(fd, loop->busy_poll_us);
+    }
     if (locked)
         doops_unlock(&loop->lock);
     return 0;
 }
 
+static int loop_add_io_data(struct doops_loop *loop, int fd, int mode, void *userdata) {
+    return _private_loop_add_io_data(loop, fd, mode, userdata, 0);
+}
+
 static int loop_add_io(struct doops_loop *loop, int fd, int mode) {
     return loop_add_io_data(loop, fd, mode, NULL);
 }
 
-static int loop_pause_write_io(struct doops_loop *loop, int fd) {
-    if (!loop) {
+// read_callback/write_callback are called only for fd, instead of the loop_io handlers
+static int loop_add_io_cb(struct doops_loop *loop, int fd, int mode, doop_io_callback read_callback, doop_io_callback write_callback, void *userdata) {
+    if ((fd < 0) || (!loop)) {
         errno = EINVAL;
         return -1;
     }
-#ifdef WITH_KQUEUE
-    // using EV_CLEAR instead
-    // struct kevent event;
-    // EV_SET(&event, fd, EVFILT_WRITE, EV_ADD | EV_DISABLE, 0, 0, 0);
-    // return kevent(loop->poll_fd, &event, 1, NULL, 0, NULL);
-#else
-#ifdef WITH_POLL
-    int i;
-    if (loop->fds) {
-        for (i = 0; i < loop->max_fd; i ++) {
-            if (loop->fds[i].fd == fd) {
-                loop->fds[i].events &= ~POLLOUT;
-                break;
-            }
-        }
+    if (_private_loop_fd_table(loop, fd))
+        return -1;
+    loop->fd_table[fd].on_read = read_callback;
+    loop->fd_table[fd].on_write = write_callback;
+    if (loop_add_io_data(loop, fd, mode, userdata)) {
+        loop->fd_table[fd].on_read = NULL;
+        loop->fd_table[fd].on_write = NULL;
+        return -1;
     }
-#else
-#ifdef WITH_SELECT
-    FD_CLR(fd, &loop->outlist);
-#endif
-#endif
-#endif
     return 0;
 }
 
-static int loop_resume_write_io(struct doops_loop *loop, int fd) {
-    if (!loop) {
-        errno = EINVAL;
+// applies a new read/write interest to a registered fd; no system call if it didn't change
+static int _private_loop_set_interest(struct doops_loop *loop, int fd, unsigned char interest) {
+    if ((fd < 0) || (fd >= loop->fd_table_size) || (!(loop->fd_table[fd].interest & DOOPS_IO_REGISTERED))) {
+        errno = ENOENT;
         return -1;
     }
-#ifdef WITH_KQUEUE
-    // using EV_CLEAR instead
-    // struct kevent event;
-    // EV_SET(&event, fd, EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, 0);
-    // return kevent(loop->poll_fd, &event, 1, NULL, 0, NULL);
+    unsigned char previous = loop->fd_table[fd].interest;
+    if ((previous & DOOPS_IO_INTEREST) == interest)
+        return 0;
+#ifdef WITH_IO_URING
+    if (_private_uring_mark(loop, fd))
+        return -1;
 #else
-#ifdef WITH_POLL
-    int i;
-    if (loop->fds) {
-        for (i = 0; i < loop->max_fd; i ++) {
-            if (loop->fds[i].fd == fd) {
-                loop->fds[i].events |= POLLOUT;
-                break;
-            }
-        }
+#ifdef WITH_EPOLL
+    // EPOLLEXCLUSIVE registrations cannot be modified
+    if (previous & DOOPS_IO_EXCLUSIVE) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct epoll_event event;
+    // supress valgrind warning
+    event.data.u64 = 0;
+    event.data.fd = fd;
+    event.events = _private_epoll_events(interest);
+    if (epoll_ctl(loop->poll_fd, EPOLL_CTL_MOD, fd, &event))
+        return -1;
+#else
+#ifdef WITH_KQUEUE
+    struct kevent events[2];
+    int num_events = 0;
+    if ((previous ^ interest) & DOOPS_IO_READ) {
+        EV_SET(&events[0], fd, EVFILT_READ, (interest & DOOPS_IO_READ) ? (EV_ADD | EV_ENABLE | EV_CLEAR) : EV_DISABLE, 0, 0, 0);
+        events[0].udata = DOOPS_UDATA(loop, fd);
+        num_events ++;
+    }
+    if ((previous ^ interest) & DOOPS_IO_WRITE) {
+        EV_SET(&events[num_events], fd, EVFILT_WRITE, (interest & DOOPS_IO_WRITE) ? (EV_ADD | EV_ENABLE | EV_CLEAR) : EV_DISABLE, 0, 0, 0);
+        events[num_events].udata = DOOPS_UDATA(loop, fd);
+        num_events ++;
     }
+    if (kevent(loop->poll_fd, events, num_events, NULL, 0, NULL))
+        return -1;
 #else
-#ifdef WITH_SELECT
-    FD_SET(fd, &loop->outlist);
+#ifdef WITH_POLL
+    loop->fds[loop->fd_table[fd].poll_slot - 1].events = (short)_private_poll_events(interest);
+#else
+    if (interest & DOOPS_IO_READ)
+        FD_SET(fd, &loop->inlist);
+    else
+        FD_CLR(fd, &loop->inlist);
+    if (interest & DOOPS_IO_WRITE)
+        FD_SET(fd, &loop->outlist);
+    else
+        FD_CLR(fd, &loop->outlist);
 #endif
 #endif
 #endif
+#endif
+    loop->fd_table[fd].interest = (previous & ~DOOPS_IO_INTEREST) | interest;
     return 0;
 }
 
+static int _private_loop_pause_io(struct doops_loop *loop, int fd, unsigned char interest, int resume) {
+    if (!loop) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((fd < 0) || (fd >= loop->fd_table_size)) {
+        errno = ENOENT;
+        return -1;
+    }
+    unsigned char current = loop->fd_table[fd].interest & DOOPS_IO_INTEREST;
+    return _private_loop_set_interest(loop, fd, resume ? (current | interest) : (current & ~interest));
+}
+
+static int loop_pause_write_io(struct doops_loop *loop, int fd) {
+    return _private_loop_pause_io(loop, fd, DOOPS_IO_WRITE, 0);
+}
+
+static int loop_resume_write_io(struct doops_loop *loop, int fd) {
+    return _private_loop_pause_io(loop, fd, DOOPS_IO_WRITE, 1);
+}
+
+static int loop_pause_read_io(struct doops_loop *loop, int fd) {
+    return _private_loop_pause_io(loop, fd, DOOPS_IO_READ, 0);
+}
+
+static int loop_resume_read_io(struct doops_loop *loop, int fd) {
+    return _private_loop_pause_io(loop, fd, DOOPS_IO_READ, 1);
+}
+
+static void _private_loop_idle_remove(struct doops_loop *loop, int fd);
+
 static int loop_remove_io(struct doops_loop *loop, int fd) {
     if ((fd < 0) || (!loop)) {
         errno = EINVAL;
         return -1;
     }
     _private_loop_init_io(loop);
+    // not registered (or already removed), io_objects must not be decremented twice
+    if ((fd >= loop->fd_table_size) || (!(loop->fd_table[fd].interest & DOOPS_IO_REGISTERED))) {
+        errno = ENOENT;
+        return -1;
+    }
+    loop->fd_table[fd].on_read = NULL;
+    loop->fd_table[fd].on_write = NULL;
+    loop->fd_table[fd].user_data = NULL;
+    loop->fd_table[fd].read_waiter = NULL;
+    loop->fd_table[fd].write_waiter = NULL;
+    _private_loop_release_fd_events(loop, fd);
+    if (loop->fd_table[fd].idle_slot)
+        _private_loop_idle_remove(loop, fd);
+#ifdef WITH_IO_URING
+    if (_private_uring_mark(loop, fd))
+        return -1;
+    loop->fd_table[fd].interest = 0;
+    loop->io_objects --;
+    // the poll request holds a reference to the file, submitted now so that close(fd) releases it
+    if (loop->fd_table[fd].uring_armed) {
+        _private_uring_flush_polls(loop);
+        _private_uring_enter(loop, 0, -1);
+    }
+    return 0;
+#else
 #ifdef WITH_EPOLL
     struct epoll_event event;
     // supress valgrind warning
     event.data.u64 = 0;
     event.data.fd = fd;
     event.events = 0;
-    if (fd == loop->max_fd - 1)
-        loop->max_fd --;
     int err = epoll_ctl (loop->poll_fd, EPOLL_CTL_DEL, fd, &event);
-    if (!err)
+    if (!err) {
+        loop->fd_table[fd].interest = 0;
         loop->io_objects --;
+    }
     return err;
 #else
 #ifdef WITH_KQUEUE
@@ -597,22 +1848,15 @@ static int loop_remove_io(struct doops_loop *loop, int fd) {
     kevent(loop->poll_fd, &event, 1, NULL, 0, NULL);
 #else
 #ifdef WITH_POLL
-    if ((loop->max_fd) && (loop->fds)) {
-        int i;
-        int found = 0;
-        for (i = 0; i < loop->max_fd; i ++) {
-            if (loop->fds[i].fd == fd)
-                found = 1;
-
-            if ((found) && (i < loop->max_fd - 1)) {
-                loop->fds[i] = loop->fds[i + 1];
-                if (loop->udata)
-                    loop->udata[i] = loop->udata[i + 1];
-            }
-        }
-        if (found)
-            loop->max_fd --;
+    // move the last entry in the released slot
+    int slot = loop->fd_table[fd].poll_slot - 1;
+    int last = loop->max_fd - 1;
+    if (slot != last) {
+        loop->fds[slot] = loop->fds[last];
+        loop->fd_table[loop->fds[slot].fd].poll_slot = slot + 1;
     }
+    loop->fd_table[fd].poll_slot = 0;
+    loop->max_fd --;
 #else
     FD_CLR(fd, &loop->inlist);
     FD_CLR(fd, &loop->exceptlist);
@@ -622,54 +1866,43 @@ static int loop_remove_io(struct doops_loop *loop, int fd) {
 #endif
 #endif
 #endif
+#endif
+    loop->fd_table[fd].interest = 0;
     loop->io_objects --;
     return 0;
 }
 
+// the timers scheduled by the library (stream, sendfile and listener continuations) are never removed
 static int loop_remove(struct doops_loop *loop, doop_callback callback, void *user_data) {
     if (!loop) {
         errno = EINVAL;
         return -1;
     }
     int locked = 0;
-    if (!loop->in_event) {
+    if (!_private_loop_in_callback(loop)) {
         doops_lock(&loop->lock);
         locked = 1;
-    } else
-    if (!loop->reset_in_event)
-        loop->reset_in_event = 2;
+    }
     int removed_event = 0;
     if ((loop->events) && (!loop->quit)) {
         struct doops_event *ev = loop->events;
-        struct doops_event *prev_ev = NULL;
         struct doops_event *next_ev = NULL; 
         void *userdata = loop->event_data;
         while (ev) {
             next_ev = ev->next;
-            if (((!callback) || (callback == ev->event_callback)) && ((!user_data) || (user_data == ev->user_data))) {
+            if ((!(ev->flags & DOOPS_EVENT_INTERNAL)) && ((!callback) || (callback == ev->event_callback)) && ((!user_data) || (user_data == ev->user_data))) {
                 if (loop->in_event == ev) {
                     // cannot delete current event, notify the loop
                     loop->reset_in_event = 1;
                 } else {
-                    if ((loop->udata_free) && (loop->events->user_data)) {
-                        loop->event_data = loop->events->user_data;
-                        loop->udata_free(loop, loop->events->user_data);
-                    }
-                    DOOPS_FREE(ev);
-                    if (prev_ev)
-                        prev_ev->next = next_ev;
-                    else
-                        loop->events = next_ev;
-                    ev = next_ev;
-                    if (ev)
-                        next_ev = ev->next;
+                    _private_loop_unlink_event(loop, ev);
+                    _private_timer_remove(loop, ev);
+                    _private_loop_free_event(loop, ev);
                 }
                 removed_event ++;
                 if ((callback) && (user_data))
                     break;
-                continue;
             }
-            prev_ev = ev;
             ev = next_ev;
         }
         loop->event_data = userdata;
@@ -679,6 +1912,109 @@ static int loop_remove(struct doops_loop *loop, doop_callback callback, void *us
     return removed_event;
 }
 
+static int _private_loop_timer_lock(struct doops_timer *timer) {
+    if ((!timer) || (!timer->loop)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct doops_loop *loop = timer->loop;
+    int locked = 0;
+    if (!_private_loop_in_callback(loop)) {
+        doops_lock(&loop->lock);
+        locked = 1;
+    }
+    // expired, cancelled or already reused by another event
+    if ((!timer->event) || (!timer->id) || (timer->event->id != timer->id)) {
+        if (locked)
+            doops_unlock(&loop->lock);
+        timer->event = NULL;
+        errno = ENOENT;
+        return -1;
+    }
+    return locked;
+}
+
+// O(log n); the handle is cleared
+static int loop_timer_cancel(struct doops_timer *timer) {
+    int locked = _private_loop_timer_lock(timer);
+    if (locked < 0)
+        return -1;
+    struct doops_loop *loop = timer->loop;
+    struct doops_event *ev = timer->event;
+    if (loop->in_event == ev) {
+        // cannot delete current event, notify the loop
+        loop->reset_in_event = 1;
+        ev->id = 0;
+    } else {
+        _private_loop_unlink_event(loop, ev);
+        _private_timer_remove(loop, ev);
+        _private_loop_free_event(loop, ev);
+    }
+    if (locked)
+        doops_unlock(&loop->lock);
+    timer->event = NULL;
+    timer->id = 0;
+    return 0;
+}
+
+static int _private_loop_timer_reschedule(struct doops_timer *timer, int64_t interval_us, unsigned int flags) {
+    int locked = _private_loop_timer_lock(timer);
+    if (locked < 0)
+        return -1;
+    struct doops_loop *loop = timer->loop;
+    struct doops_event *ev = timer->event;
+    flags |= ev->flags & DOOPS_EVENT_INTERNAL;
+    if (ev->heap_index == DOOPS_TIMER_DETACHED) {
+        // running, the loop pushes it back after the callback returns
+        _private_loop_set_deadline(ev, interval_us, flags | DOOPS_EVENT_RESCHEDULED);
+    } else {
+        _private_timer_remove(loop, ev);
+        _private_loop_set_deadline(ev, interval_us, flags);
+        // cannot fail, the slot was just released
+        _private_timer_push(loop, ev);
+        if ((loop->sleeping) && (_private_timer_wakes(loop, ev)))
+            loop_wakeup(loop);
+    }
+    if (locked)
+        doops_unlock(&loop->lock);
+    return 0;
+}
+
+// moves the deadline to now + interval (ms); also sets the new period
+static int loop_timer_reschedule(struct doops_timer *timer, int64_t interval) {
+    return _private_loop_timer_reschedule(timer, interval * 1000, 0);
+}
+
+static int loop_timer_reschedule_us(struct doops_timer *timer, int64_t interval_us) {
+    return _private_loop_timer_reschedule(timer, interval_us, DOOPS_EVENT_PRECISE);
+}
+
+// lets the timer fire up to slack_us late, used from the next wait
+static int loop_timer_slack(struct doops_timer *timer, int64_t slack_us) {
+    if (slack_us < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    int locked = _private_loop_timer_lock(timer);
+    if (locked < 0)
+        return -1;
+    timer->event->slack = (uint64_t)slack_us;
+    if (locked)
+        doops_unlock(&timer->loop->lock);
+    return 0;
+}
+
+// default slack of the timers added after this call
+static int loop_set_timer_slack(struct doops_loop *loop, int64_t slack_us) {
+    if ((!loop) || (slack_us < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    loop->timer_slack = (uint64_t)slack_us;
+    return 0;
+}
+
+// the timers scheduled by the library are not visited
 static int loop_foreach_callback(struct doops_loop *loop, void *foreachcallback, doop_foreach_callback callback, void *foreachdata) {
     if ((!loop) || (!callback)) {
         errno = EINVAL;
@@ -688,35 +2024,22 @@ static int loop_foreach_callback(struct doops_loop *loop, void *foreachcallback,
     int removed_event = 0;
     if ((loop->events) && (!loop->quit)) {
         struct doops_event *ev = loop->events;
-        struct doops_event *prev_ev = NULL;
         struct doops_event *next_ev = NULL; 
         void *userdata = loop->event_data;
         while ((ev) && (!loop->quit)) {
             next_ev = ev->next;
-            if ((ev->event_callback == foreachcallback) || (!foreachcallback)) {
+            if ((!(ev->flags & DOOPS_EVENT_INTERNAL)) && ((ev->event_callback == foreachcallback) || (!foreachcallback))) {
                 loop->event_data = ev->user_data;
                 int ret_code = callback(loop, foreachdata);
                 if (ret_code < 0)
                     break;
                 if (ret_code) {
-                    if ((loop->udata_free) && (ev->user_data))
-                        loop->udata_free(loop, ev->user_data);
-#ifdef WITH_BLOCKS
-                    if (ev->event_block)
-                        Block_release(ev->event_block);
-#endif
-                    DOOPS_FREE(ev);
-                    if (prev_ev)
-                        prev_ev->next = next_ev;
-                    else
-                        loop->events = next_ev;
-                    ev = next_ev;
+                    _private_loop_unlink_event(loop, ev);
+                    _private_timer_remove(loop, ev);
+                    _private_loop_free_event(loop, ev);
                     removed_event ++;
-                    if (ret_code != 1)
-                        continue;
                 }
             }
-            prev_ev = ev;
             ev = next_ev;
         }
         loop->event_data = userdata;
@@ -730,387 +2053,3119 @@ static int loop_foreach(struct doops_loop *loop, doop_foreach_callback callback,
 }
 
 static void loop_quit(struct doops_loop *loop) {
-    if (loop)
+    if (loop) {
         loop->quit = 1;
+        // called from another thread, a tickless loop may wait indefinitely
+        if (loop->sleeping)
+            loop_wakeup(loop);
+    }
+}
+
+// thread-safe: callback will run once on the loop thread, user_data is available via loop_event_data
+static int loop_post(struct doops_loop *loop, doop_callback callback, void *user_data) {
+    if ((!loop) || (!callback)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct doops_task *task = (struct doops_task *)DOOPS_MALLOC(sizeof(struct doops_task));
+    if (!task) {
+        errno = ENOMEM;
+        return -1;
+    }
+    task->callback = callback;
+    task->user_data = user_data;
+    // only the first task in an empty queue needs to wake the loop
+    if (!_private_loop_push_task(loop, task))
+        loop_wakeup(loop);
+    return 0;
+}
+
+static int _private_loop_run_tasks(struct doops_loop *loop) {
+    struct doops_task *tasks = _private_loop_take_tasks(loop);
+    struct doops_task *fifo = NULL;
+    struct doops_task *next;
+    int loops = 0;
+    // tasks are stacked, reverse them to preserve posting order
+    while (tasks) {
+        next = tasks->next;
+        tasks->next = fifo;
+        fifo = tasks;
+        tasks = next;
+    }
+    while (fifo) {
+        next = fifo->next;
+        loop->event_data = fifo->user_data;
+#ifdef DOOPS_STATS
+        uint64_t start = microseconds();
+        fifo->callback(loop);
+        _private_loop_stats_callback(loop, &loop->stats.tasks_run, start, (doop_any_callback)fifo->callback, -1);
+#else
+        fifo->callback(loop);
+#endif
+        DOOPS_FREE(fifo);
+        fifo = next;
+        loops ++;
+    }
+    return loops;
+}
+
+// loop thread only: callback runs on the next iteration, before waiting, in the order the callbacks were deferred
+static int loop_defer(struct doops_loop *loop, doop_callback callback, void *user_data) {
+    if ((!loop) || (!callback)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (loop->deferred_count == loop->deferred_size) {
+        unsigned int size = loop->deferred_size ? loop->deferred_size * 2 : DOOPS_DEFER_MIN;
+        struct doops_deferred *deferred = (struct doops_deferred *)_private_loop_malloc(loop, sizeof(struct doops_deferred) * size);
+        if (!deferred) {
+            errno = ENOMEM;
+            return -1;
+        }
+        // unwrap the ring
+        unsigned int i;
+        for (i = 0; i < loop->deferred_count; i ++)
+            deferred[i] = loop->deferred[(loop->deferred_head + i) & (loop->deferred_size - 1)];
+        _private_loop_free(loop, loop->deferred);
+        loop->deferred = deferred;
+        loop->deferred_size = size;
+        loop->deferred_head = 0;
+    }
+    struct doops_deferred *entry = &loop->deferred[(loop->deferred_head + loop->deferred_count) & (loop->deferred_size - 1)];
+    entry->callback = callback;
+    entry->user_data = user_data;
+    loop->deferred_count ++;
+    return 0;
 }
 
+static int _private_loop_run_deferred(struct doops_loop *loop) {
+    // callbacks deferred by these callbacks run on the next iteration
+    unsigned int count = loop->deferred_count;
+    unsigned int i;
+    for (i = 0; (i < count) && (!loop->quit); i ++) {
+        // the ring may be reallocated by the callback
+        struct doops_deferred entry = loop->deferred[loop->deferred_head];
+        loop->deferred_head = (loop->deferred_head + 1) & (loop->deferred_size - 1);
+        loop->deferred_count --;
+        loop->event_data = entry.user_data;
+#ifdef DOOPS_STATS
+        uint64_t start = microseconds();
+        entry.callback(loop);
+        _private_loop_stats_callback(loop, &loop->stats.deferred_run, start, (doop_any_callback)entry.callback, -1);
+#else
+        entry.callback(loop);
+#endif
+    }
+    return (int)i;
+}
+
+// budget of a timer or I/O dispatch that started at start (us) and made count callbacks
+static int _private_loop_budget_exhausted(struct doops_loop *loop, unsigned int count, uint64_t start) {
+    if ((loop->budget_callbacks) && (count >= loop->budget_callbacks))
+        return 1;
+    if (loop->budget_us) {
+        uint64_t now = microseconds();
+        if ((now > start) && (now - start >= loop->budget_us))
+            return 1;
+    }
+    return 0;
+}
+
+// sleep_val is set in microseconds
 static int _private_loop_iterate(struct doops_loop *loop, int *sleep_val) {
     int loops = 0;
+#ifdef DOOPS_STATS
+    loop->stats.iterations ++;
+#endif
+    // without the wake up descriptor, tasks posted by other threads are only seen by polling
+    int tickless = (loop->tickless) && (loop->wakeup_fd > 0);
     if (sleep_val)
-        *sleep_val = DOOPS_MAX_SLEEP;
+        *sleep_val = tickless ? -1 : DOOPS_MAX_SLEEP * 1000;
+    if (_private_loop_peek_tasks(loop))
+        loops += _private_loop_run_tasks(loop);
+    if (loop->deferred_count)
+        loops += _private_loop_run_deferred(loop);
     doops_lock(&loop->lock);
-    if ((loop->events) && (!loop->quit)) {
-        struct doops_event *ev = loop->events;
-        struct doops_event *prev_ev = NULL;
-        struct doops_event *next_ev = NULL; 
-        while ((ev) && (!loop->quit)) {
-            next_ev = ev->next;
-            uint64_t now = milliseconds();
-            if (ev->when <= now) {
-                loops ++;
-                loop->event_data = ev->user_data;
-                int remove_event = 1;
-                loop->in_event = ev;
-                loop->reset_in_event = 0;
-#ifdef WITH_BLOCKS
-                if (ev->event_block)
-                    remove_event = ev->event_block(loop);
-                else
+#ifndef DOOPS_NO_THREADS
+#ifdef _WIN32
+    InterlockedExchangePointer((PVOID volatile *)&loop->loop_thread, (PVOID)_private_loop_thread_id());
+#else
+    __atomic_store_n(&loop->loop_thread, _private_loop_thread_id(), __ATOMIC_RELAXED);
+#endif
+#endif
+    loop->wake_at = 0;
+    if ((loop->timers_count) && (!loop->quit)) {
+        uint64_t now = microseconds();
+        // events (re)scheduled by the callbacks will run on the next iteration
+        uint64_t seq_limit = loop->timers_seq;
+        unsigned int fired = 0;
+        while ((loop->timers_count) && (!loop->quit)) {
+            struct doops_event *ev = loop->timers[0];
+            if ((ev->when > now) || (ev->seq >= seq_limit))
+                break;
+            // the timers left by the budget are due, the loop won't wait for them
+            if ((fired) && (_private_loop_budget_exhausted(loop, fired, now)))
+                break;
+            _private_timer_remove(loop, ev);
+            loops ++;
+            fired ++;
+            loop->event_data = ev->user_data;
+            int remove_event = 1;
+            loop->in_event = ev;
+            loop->reset_in_event = 0;
+#ifdef DOOPS_STATS
+            doop_callback callback = ev->event_callback;
+            uint64_t start = microseconds();
+            _private_loop_stats_add(loop->stats.timer_late_hist, (start > ev->when) ? start - ev->when : 0);
 #endif
-                if (ev->event_callback)
-                    remove_event = ev->event_callback(loop);
-                // remove_event called on the current event
-                if (loop->reset_in_event) {
-                    next_ev = ev->next;
-                    prev_ev = NULL;
-                    struct doops_event *ev_2 = loop->events;
-                    while ((ev_2) && (ev != ev_2)) {
-                        prev_ev = ev_2;
-                        ev_2 = ev_2->next;
-                    }
-
-                    if (loop->reset_in_event == 1)
-                        remove_event = 1;
-                    loop->reset_in_event = 0;
-
-                    *sleep_val = 0;
-                }
-                loop->in_event = NULL;
-                if (remove_event) {
-                    if ((loop->udata_free) && (ev->user_data))
-                        loop->udata_free(loop, ev->user_data);
 #ifdef WITH_BLOCKS
-                    if (ev->event_block)
-                        Block_release(ev->event_block);
-#endif
-                    DOOPS_FREE(ev);
-                    if (prev_ev)
-                        prev_ev->next = next_ev;
-                    else
-                        loop->events = next_ev;
-                    ev = next_ev;
-                    continue;
-                }
-                while ((ev->when <= now) && (ev->interval))
-                    ev->when += ev->interval;
+            if (ev->event_block)
+                remove_event = ev->event_block(loop);
+            else
+#endif
+            if (ev->event_callback)
+                remove_event = ev->event_callback(loop);
+#ifdef DOOPS_STATS
+            _private_loop_stats_callback(loop, &loop->stats.timers_fired, start, (doop_any_callback)callback, -1);
+#endif
+            // loop_timer_reschedule called on the current event keeps it
+            if (ev->flags & DOOPS_EVENT_RESCHEDULED)
+                remove_event = 0;
+            // remove_event called on the current event
+            if (loop->reset_in_event)
+                remove_event = 1;
+            loop->reset_in_event = 0;
+            loop->in_event = NULL;
+            if (remove_event) {
+                _private_loop_unlink_event(loop, ev);
+                _private_loop_free_event(loop, ev);
+                continue;
             }
-            if (sleep_val) {
-                int delta = (int)(ev->when - now);
-                if (delta < *sleep_val)
-                    *sleep_val = delta;
+            if (ev->flags & DOOPS_EVENT_RESCHEDULED) {
+                ev->flags &= ~DOOPS_EVENT_RESCHEDULED;
+            } else
+            if (ev->interval) {
+                if (ev->when <= now)
+                    ev->when += ((now - ev->when) / ev->interval + 1) * ev->interval;
+            } else
+                ev->when = now;
+            // cannot fail, the slot was just released
+            _private_timer_push(loop, ev);
+        }
+        if (sleep_val) {
+            if (!loop->timers_count) {
+                *sleep_val = 0;
+            } else
+            if (loop->timers[0]->when <= now) {
+                *sleep_val = 0;
+            } else {
+                loop->wake_at = _private_timer_wake(loop, 0, (uint64_t)-1);
+                uint64_t limit = (uint64_t)(tickless ? DOOPS_MAX_TICKLESS_SLEEP : DOOPS_MAX_SLEEP) * 1000;
+                if (loop->wake_at - now < limit) {
+                    *sleep_val = (int)(loop->wake_at - now);
+                    // millisecond timers don't need a sub-millisecond wake up
+                    if (!(loop->timers[0]->flags & DOOPS_EVENT_PRECISE))
+                        *sleep_val = ((*sleep_val + 999) / 1000) * 1000;
+                } else
+                    *sleep_val = (int)limit;
             }
-            prev_ev = ev;
-            ev = next_ev;
         }
-        if (!loop->events)
+    }
+    if (sleep_val) {
+        if ((_private_loop_peek_tasks(loop)) || (loop->deferred_count))
             *sleep_val = 0;
+        // from now on, loop_add from other threads must wake the loop
+        loop->sleeping = 1;
+    }
+    doops_unlock(&loop->lock);
+    return loops;
+}
+
+static int loop_iterate(struct doops_loop *loop) {
+    return _private_loop_iterate(loop, NULL);
+}
+
+static int loop_idle(struct doops_loop *loop, doop_idle_callback callback) {
+    if (!loop) {
+        errno = EINVAL;
+        return -1;
+    }
+    loop->idle = callback;
+    return 0;
+}
+
+static int loop_io(struct doops_loop *loop, doop_io_callback read_callback, doop_io_callback write_callback) {
+    if (!loop) {
+        errno = EINVAL;
+        return -1;
+    }
+    loop->io_read = read_callback;
+    loop->io_write = write_callback;
+#ifdef WITH_BLOCK
+    if (loop->io_read_block) {
+        Block_release(loop->io_read_block);
+        loop->io_read_block = NULL;
+    }
+    if (loop->io_write_block) {
+        Block_release(loop->io_write_block);
+        loop->io_write_block = NULL;
+    }
+#endif
+    return 0;
+}
+
+static void _private_loop_remove_events(struct doops_loop *loop) {
+    struct doops_event *next_ev;
+    doops_lock(&loop->lock);
+    while (loop->events) {
+        next_ev = loop->events->next;
+        _private_loop_free_event(loop, loop->events);
+        loop->events = next_ev;
+    }
+    if (loop->timers) {
+        _private_loop_free(loop, loop->timers);
+        loop->timers = NULL;
+    }
+    loop->timers_count = 0;
+    loop->timers_size = 0;
+    doops_unlock(&loop->lock);
+}
+
+#define LOOP_HAS_IO(loop) ((LOOP_IS_READABLE(loop)) || (LOOP_IS_WRITABLE(loop)) || (loop->wakeup_fd > 0) || (loop->fd_table_size))
+#define DOOPS_UDATA(loop, index) (((index) < loop->fd_table_size) ? loop->fd_table[index].user_data : NULL)
+
+static uint64_t _private_loop_idle_now() {
+    return microseconds() / (DOOPS_IDLE_RESOLUTION * 1000);
+}
+
+// first tick starting at or after now + timeout_ms
+static uint64_t _private_loop_idle_deadline(unsigned int timeout_ms) {
+    return (microseconds() + (uint64_t)timeout_ms * 1000 + DOOPS_IDLE_RESOLUTION * 1000 - 1) / (DOOPS_IDLE_RESOLUTION * 1000);
+}
+
+// slot is 1-based, DOOPS_IDLE_SLOTS + 1 is the list being expired
+static void _private_loop_idle_link(struct doops_loop *loop, int fd, unsigned int slot) {
+    struct doops_fd *fd_state = &loop->fd_table[fd];
+    fd_state->idle_slot = slot;
+    fd_state->idle_prev = 0;
+    fd_state->idle_next = loop->idle_wheel[slot - 1];
+    if (fd_state->idle_next)
+        loop->fd_table[fd_state->idle_next - 1].idle_prev = fd + 1;
+    loop->idle_wheel[slot - 1] = fd + 1;
+}
+
+static void _private_loop_idle_unlink(struct doops_loop *loop, int fd) {
+    struct doops_fd *fd_state = &loop->fd_table[fd];
+    if (fd_state->idle_prev)
+        loop->fd_table[fd_state->idle_prev - 1].idle_next = fd_state->idle_next;
+    else
+        loop->idle_wheel[fd_state->idle_slot - 1] = fd_state->idle_next;
+    if (fd_state->idle_next)
+        loop->fd_table[fd_state->idle_next - 1].idle_prev = fd_state->idle_prev;
+    fd_state->idle_slot = 0;
+    fd_state->idle_prev = 0;
+    fd_state->idle_next = 0;
+}
+
+// the fd goes in the slot of its deadline, or in the farthest one if the deadline is more than a turn after tick; returns the tick of the slot
+static uint64_t _private_loop_idle_place(struct doops_loop *loop, int fd, uint64_t tick) {
+    uint64_t deadline = loop->fd_table[fd].idle_deadline;
+    if (deadline > tick + DOOPS_IDLE_SLOTS - 1)
+        deadline = tick + DOOPS_IDLE_SLOTS - 1;
+    _private_loop_idle_link(loop, fd, (unsigned int)(deadline % DOOPS_IDLE_SLOTS) + 1);
+    return deadline;
+}
+
+// O(1), the fd keeps its slot and moves forward when the slot expires
+static void _private_loop_idle_refresh(struct doops_loop *loop, int fd) {
+    loop->fd_table[fd].idle_deadline = _private_loop_idle_deadline(loop->fd_table[fd].idle_timeout);
+}
+
+static void _private_loop_idle_remove(struct doops_loop *loop, int fd) {
+    _private_loop_idle_unlink(loop, fd);
+    loop->fd_table[fd].idle_timeout = 0;
+    loop->idle_count --;
+    // nothing left to expire, the wheel timer must not keep loop_run running
+    if (!loop->idle_count)
+        loop_timer_cancel(&loop->idle_timer);
+}
+
+static int _private_loop_idle_expire(struct doops_loop *loop);
+
+static int _private_loop_idle_schedule(struct doops_loop *loop, uint64_t tick) {
+    int64_t interval_us = (int64_t)(tick * DOOPS_IDLE_RESOLUTION * 1000) - (int64_t)microseconds();
+    if (interval_us < 0)
+        interval_us = 0;
+    if (_private_loop_timer_reschedule(&loop->idle_timer, interval_us, 0)) {
+        // internal, loop_remove and loop_foreach must not stop the wheel
+        memset(&loop->idle_timer, 0, sizeof(struct doops_timer));
+        if (_private_loop_add(loop, _private_loop_idle_expire, interval_us, NULL, DOOPS_EVENT_INTERNAL | DOOPS_EVENT_PRECISE, &loop->idle_timer))
+            return -1;
+    }
+    loop->idle_wake = tick;
+    return 0;
+}
+
+// wheel timer, expires the slots up to the current tick and sleeps until the next non-empty slot
+static int _private_loop_idle_expire(struct doops_loop *loop) {
+    uint64_t now = _private_loop_idle_now();
+    // blocked for more than a turn, every slot is visited once
+    if (now - loop->idle_tick > DOOPS_IDLE_SLOTS)
+        loop->idle_tick = now - DOOPS_IDLE_SLOTS;
+    int *expiring = &loop->idle_wheel[DOOPS_IDLE_SLOTS];
+    while ((loop->idle_tick < now) && (loop->idle_count)) {
+        loop->idle_tick ++;
+        unsigned int slot = (unsigned int)(loop->idle_tick % DOOPS_IDLE_SLOTS);
+        // moved to a separate list, the callbacks may remove any fd
+        *expiring = loop->idle_wheel[slot];
+        loop->idle_wheel[slot] = 0;
+        int next;
+        for (next = *expiring; next; next = loop->fd_table[next - 1].idle_next)
+            loop->fd_table[next - 1].idle_slot = DOOPS_IDLE_SLOTS + 1;
+        while (*expiring) {
+            int fd = *expiring - 1;
+            _private_loop_idle_unlink(loop, fd);
+            if (loop->fd_table[fd].idle_deadline > now) {
+                // refreshed since it was placed
+                _private_loop_idle_place(loop, fd, loop->idle_tick);
+                continue;
+            }
+            loop->fd_table[fd].idle_timeout = 0;
+            loop->idle_count --;
+            if (!loop->idle_count)
+                loop_timer_cancel(&loop->idle_timer);
+            if (loop->idle_callback) {
+                loop->event_fd = fd;
+                loop->event_data = DOOPS_UDATA(loop, fd);
+                loop->idle_callback(loop, fd);
+            }
+        }
+    }
+    if (loop->idle_count) {
+        unsigned int i;
+        for (i = 1; i < DOOPS_IDLE_SLOTS; i ++) {
+            if (loop->idle_wheel[(loop->idle_tick + i) % DOOPS_IDLE_SLOTS])
+                break;
+        }
+        _private_loop_idle_schedule(loop, loop->idle_tick + i);
+    }
+    // cancelled, or replaced by a callback that set a timeout after the last one expired
+    return loop->idle_timer.event != loop->in_event;
+}
+
+// fd must be registered; callback(loop, fd) runs timeout_ms after the last read or write event (up to DOOPS_IDLE_RESOLUTION ms later), 0 removes the timeout
+static int loop_set_io_timeout(struct doops_loop *loop, int fd, int timeout_ms) {
+    if ((!loop) || (fd < 0) || (timeout_ms < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((fd >= loop->fd_table_size) || (!(loop->fd_table[fd].interest & DOOPS_IO_REGISTERED))) {
+        errno = ENOENT;
+        return -1;
+    }
+    struct doops_fd *fd_state = &loop->fd_table[fd];
+    if (!timeout_ms) {
+        if (fd_state->idle_slot)
+            _private_loop_idle_remove(loop, fd);
+        return 0;
+    }
+    if (!loop->idle_wheel) {
+        loop->idle_wheel = (int *)_private_loop_malloc(loop, sizeof(int) * (DOOPS_IDLE_SLOTS + 1));
+        if (!loop->idle_wheel) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(loop->idle_wheel, 0, sizeof(int) * (DOOPS_IDLE_SLOTS + 1));
+    }
+    uint64_t now = _private_loop_idle_now();
+    int start = !loop->idle_count;
+    if (start)
+        loop->idle_tick = now;
+    if (fd_state->idle_slot)
+        _private_loop_idle_unlink(loop, fd);
+    else
+        loop->idle_count ++;
+    fd_state->idle_timeout = (unsigned int)timeout_ms;
+    fd_state->idle_deadline = _private_loop_idle_deadline(fd_state->idle_timeout);
+    uint64_t tick = _private_loop_idle_place(loop, fd, loop->idle_tick);
+    if (((start) || (tick < loop->idle_wake)) && (_private_loop_idle_schedule(loop, tick))) {
+        _private_loop_idle_remove(loop, fd);
+        return -1;
+    }
+    return 0;
+}
+
+// activity not seen by the loop (data written directly, a request completed), O(1)
+static int loop_refresh_io_timeout(struct doops_loop *loop, int fd) {
+    if ((!loop) || (fd < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((fd >= loop->fd_table_size) || (!loop->fd_table[fd].idle_timeout)) {
+        errno = ENOENT;
+        return -1;
+    }
+    _private_loop_idle_refresh(loop, fd);
+    return 0;
+}
+
+// called with the expired fd (its timeout is removed), usually closes it
+static void loop_on_io_timeout(struct doops_loop *loop, doop_io_callback callback) {
+    if (loop)
+        loop->idle_callback = callback;
+}
+
+// per-fd handlers take precedence over the loop handlers
+static void _private_loop_io_read(struct doops_loop *loop, int fd, void *data) {
+    loop->event_fd = fd;
+    loop->event_data = data;
+    doop_io_callback callback = loop->io_read;
+    if ((fd < loop->fd_table_size) && (loop->fd_table[fd].idle_timeout))
+        _private_loop_idle_refresh(loop, fd);
+    if ((fd < loop->fd_table_size) && (loop->fd_table[fd].on_read))
+        callback = loop->fd_table[fd].on_read;
+#ifdef WITH_BLOCKS
+    else
+    if (loop->io_read_block)
+        callback = NULL;
+#endif
+#ifdef DOOPS_STATS
+    uint64_t start = microseconds();
+#endif
+    if (callback)
+        callback(loop, fd);
+#ifdef WITH_BLOCKS
+    else
+    if (loop->io_read_block)
+        loop->io_read_block(loop, fd);
+#endif
+#ifdef DOOPS_STATS
+    _private_loop_stats_callback(loop, &loop->stats.io_events, start, (doop_any_callback)callback, fd);
+#endif
+}
+
+static void _private_loop_io_write(struct doops_loop *loop, int fd, void *data) {
+    loop->event_fd = fd;
+    loop->event_data = data;
+    doop_io_callback callback = loop->io_write;
+    if ((fd < loop->fd_table_size) && (loop->fd_table[fd].idle_timeout))
+        _private_loop_idle_refresh(loop, fd);
+    if ((fd < loop->fd_table_size) && (loop->fd_table[fd].on_write))
+        callback = loop->fd_table[fd].on_write;
+#ifdef WITH_BLOCKS
+    else
+    if (loop->io_write_block)
+        callback = NULL;
+#endif
+#ifdef DOOPS_STATS
+    uint64_t start = microseconds();
+#endif
+    if (callback)
+        callback(loop, fd);
+#ifdef WITH_BLOCKS
+    else
+    if (loop->io_write_block)
+        loop->io_write_block(loop, fd);
+#endif
+#ifdef DOOPS_STATS
+    _private_loop_stats_callback(loop, &loop->stats.io_events, start, (doop_any_callback)callback, fd);
+#endif
+}
+
+#if !defined(DOOPS_NO_IO_EVENTS) && !defined(_WIN32)
+static void _private_loop_init_wakeup(struct doops_loop *loop) {
+    if (loop->wakeup_fd > 0)
+        return;
+#if defined(WITH_EPOLL) || defined(WITH_IO_URING)
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd <= 0)
+        return;
+    loop->wakeup_fd = fd;
+    loop->wakeup_write_fd = fd;
+#else
+    int fds[2];
+    if (pipe(fds))
+        return;
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    loop->wakeup_fd = fds[0];
+    loop->wakeup_write_fd = fds[1];
+#endif
+    // not a user object, must not keep the loop alive
+    if (loop_add_io(loop, loop->wakeup_fd, DOOPS_READ))
+        return;
+    loop->io_objects --;
+}
+#endif
+
+static void _private_loop_close_wakeup(struct doops_loop *loop) {
+    if (loop->wakeup_fd > 0) {
+        if (loop->wakeup_write_fd != loop->wakeup_fd)
+            close(loop->wakeup_write_fd);
+        close(loop->wakeup_fd);
+    }
+    loop->wakeup_fd = 0;
+    loop->wakeup_write_fd = 0;
+}
+
+// internal descriptors (timers, wake ups) are never reported to the user
+static int _private_loop_internal_io(struct doops_loop *loop, int fd) {
+    if ((loop->wakeup_fd > 0) && (fd == loop->wakeup_fd)) {
+        unsigned char buf[64];
+        // posted tasks are drained by the next iteration
+        while (read(loop->wakeup_fd, buf, sizeof(buf)) > 0) {
+            if (loop->wakeup_fd == loop->wakeup_write_fd)
+                break;
+        }
+        return 1;
+    }
+#ifdef WITH_EPOLL
+    if ((loop->timer_fd > 0) && (fd == loop->timer_fd)) {
+        uint64_t expirations;
+        // clear the expiration counter
+        if (read(loop->timer_fd, &expirations, sizeof(expirations)) < 0)
+            expirations = 0;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+#ifdef NSIG
+    #define DOOPS_MAX_SIGNAL   NSIG
+#else
+    #define DOOPS_MAX_SIGNAL   65
+#endif
+
+static void _private_loop_signal(struct doops_loop *loop, int signo) {
+    if ((signo > 0) && (signo < DOOPS_MAX_SIGNAL) && (loop->signal_callbacks) && (loop->signal_callbacks[signo]))
+        loop->signal_callbacks[signo](loop, signo);
+}
+
+#ifdef WITH_EPOLL
+// epoll_wait has millisecond resolution, use a timerfd for the sub-millisecond part
+static int _private_loop_arm_timer(struct doops_loop *loop, int sleep_val) {
+    if (loop->timer_fd <= 0) {
+        loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (loop->timer_fd <= 0) {
+            loop->timer_fd = 0;
+            return -1;
+        }
+        struct epoll_event event;
+        event.data.u64 = 0;
+        event.data.fd = loop->timer_fd;
+        event.events = EPOLLIN;
+        if (epoll_ctl(loop->poll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event)) {
+            close(loop->timer_fd);
+            loop->timer_fd = 0;
+            return -1;
+        }
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(struct itimerspec));
+    spec.it_value.tv_sec = sleep_val / 1000000;
+    spec.it_value.tv_nsec = (sleep_val % 1000000) * 1000;
+    return timerfd_settime(loop->timer_fd, 0, &spec, NULL);
+}
+#endif
+
+#ifdef WITH_IO_URING
+static void _private_uring_complete(struct doops_loop *loop, struct doops_uring_op *op, int res, unsigned int flags) {
+    loop->event_fd = op->fd;
+    loop->event_data = op->data;
+#ifdef DOOPS_STATS
+    uint64_t start = microseconds();
+    op->callback(loop, op->fd, res, op->data);
+    _private_loop_stats_callback(loop, &loop->stats.io_events, start, (doop_any_callback)op->callback, op->fd);
+#else
+    op->callback(loop, op->fd, res, op->data);
+#endif
+    if (flags & IORING_CQE_F_MORE)
+        return;
+    // multishot not supported by this kernel, or terminated: continue in single-shot mode
+    if ((op->multishot) && (res != -ECANCELED) && ((res >= 0) || (res == -EINVAL))) {
+        if (res == -EINVAL)
+            op->multishot = 0;
+        if (!_private_uring_submit_op(loop, op))
+            return;
+    }
+    loop->io_objects --;
+    _private_loop_free(loop, op);
+}
+
+// returns the number of completions
+static int _private_uring_dispatch(struct doops_loop *loop) {
+    struct doops_uring *ring = &loop->ring;
+    unsigned int head = *ring->cq_head;
+    // completions posted by the handlers (their syscalls run the ring task work) wait for the next iteration
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    int count = 0;
+    uint64_t now = loop->budget_us ? microseconds() : 0;
+    while (head != tail) {
+        // completions left by the budget stay in the ring, the next io_uring_enter returns immediately
+        if ((count) && (_private_loop_budget_exhausted(loop, (unsigned int)count, now)))
+            break;
+        count ++;
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned int flags = cqe->flags;
+        // release the slot before calling back, handlers may submit new requests
+        head ++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (user_data == DOOPS_URING_IGNORE)
+            continue;
+        if (!(user_data & DOOPS_URING_POLL)) {
+            _private_uring_complete(loop, (struct doops_uring_op *)(uintptr_t)user_data, res, flags);
+            continue;
+        }
+        int fd = (int)(user_data >> 10);
+        unsigned char gen = (unsigned char)(user_data >> 2);
+        if ((fd >= loop->fd_table_size) || (gen != loop->fd_table[fd].uring_gen))
+            continue;
+        unsigned char interest = loop->fd_table[fd].interest;
+        if ((res > 0) && (interest & DOOPS_IO_REGISTERED) && (!_private_loop_internal_io(loop, fd))) {
+            // completions already queued when the interest changed
+            res &= _private_poll_events(interest);
+            if (res & ~POLLOUT)
+                _private_loop_io_read(loop, fd, DOOPS_UDATA(loop, fd));
+            // the read handler may have removed or paused the fd
+            if ((res & POLLOUT) && (fd < loop->fd_table_size) && (loop->fd_table[fd].interest & DOOPS_IO_WRITE))
+                _private_loop_io_write(loop, fd, DOOPS_UDATA(loop, fd));
+        }
+        // poll terminated (or multishot not supported), re-armed before the next wait
+        if ((!(flags & IORING_CQE_F_MORE)) && (fd < loop->fd_table_size) && (gen == loop->fd_table[fd].uring_gen)) {
+            loop->fd_table[fd].uring_armed = 0;
+            _private_uring_mark(loop, fd);
+        }
+    }
+    return count;
+}
+#endif
+
+#if defined(WITH_EPOLL) || defined(WITH_KQUEUE)
+static int _private_loop_resize_wait(struct doops_loop *loop, int size) {
+#ifdef WITH_EPOLL
+    struct epoll_event *events = (struct epoll_event *)_private_loop_realloc(loop, loop->wait_events, sizeof(struct epoll_event) * size);
+#else
+    struct kevent *events = (struct kevent *)_private_loop_realloc(loop, loop->wait_events, sizeof(struct kevent) * size);
+#endif
+    if (!events)
+        return -1;
+    loop->wait_events = events;
+    loop->wait_events_size = size;
+    return 0;
+}
+
+// called after the events are dispatched, never while the buffer is in use
+static void _private_loop_adapt_wait(struct doops_loop *loop, int count) {
+    int max_size = loop->wait_events_max ? loop->wait_events_max : DOOPS_WAIT_EVENTS_MAX;
+    int size = loop->wait_events_size;
+    if (size > max_size) {
+        _private_loop_resize_wait(loop, max_size);
+        return;
+    }
+    // a full batch: more events are probably ready
+    if ((count >= size) && (size < max_size)) {
+        loop->wait_small_batches = 0;
+        _private_loop_resize_wait(loop, (size > max_size / 2) ? max_size : size * 2);
+        return;
+    }
+    if ((count > size / 4) || (size <= DOOPS_WAIT_EVENTS_MIN)) {
+        loop->wait_small_batches = 0;
+        return;
+    }
+    if (++ loop->wait_small_batches >= DOOPS_WAIT_SHRINK) {
+        loop->wait_small_batches = 0;
+        _private_loop_resize_wait(loop, (size / 2 < DOOPS_WAIT_EVENTS_MIN) ? DOOPS_WAIT_EVENTS_MIN : size / 2);
+    }
+}
+#endif
+
+// sleep_val is in microseconds, returns the number of events
+#if defined(WITH_EPOLL) || defined(WITH_KQUEUE)
+// returns the index of the first event left for the next iteration by the budget (count if none);
+// carried events were returned by an earlier wait, their fd may have been removed since
+#ifdef WITH_EPOLL
+static int _private_loop_dispatch_wait(struct doops_loop *loop, struct epoll_event *events, int first, int count, int carried) {
+#else
+static int _private_loop_dispatch_wait(struct doops_loop *loop, struct kevent *events, int first, int count, int carried) {
+#endif
+    uint64_t now = loop->budget_us ? microseconds() : 0;
+    unsigned int dispatched = 0;
+    int i;
+    for (i = first; i < count; i ++) {
+        if ((dispatched) && (_private_loop_budget_exhausted(loop, dispatched, now)))
+            return i;
+        dispatched ++;
+#ifdef WITH_EPOLL
+        int fd = events[i].data.fd;
+#else
+        int fd = (int)events[i].ident;
+        // ident is the signal number
+        if (events[i].filter == EVFILT_SIGNAL) {
+            _private_loop_signal(loop, fd);
+            continue;
+        }
+#endif
+        if (_private_loop_internal_io(loop, fd))
+            continue;
+        if ((carried) && ((fd >= loop->fd_table_size) || (!(loop->fd_table[fd].interest & DOOPS_IO_REGISTERED))))
+            continue;
+#ifdef WITH_EPOLL
+        if (events[i].events & EPOLLOUT)
+            _private_loop_io_write(loop, fd, DOOPS_UDATA(loop, fd));
+        if (events[i].events & ~EPOLLOUT)
+            _private_loop_io_read(loop, fd, DOOPS_UDATA(loop, fd));
+#else
+        if (events[i].filter == EVFILT_WRITE)
+            _private_loop_io_write(loop, fd, events[i].udata);
+        else
+            _private_loop_io_read(loop, fd, events[i].udata);
+#endif
+    }
+    return count;
+}
+#endif
+
+static int _private_sleep(struct doops_loop *loop, int sleep_val) {
+    if (!loop)
+        return 0;
+#ifndef DOOPS_NO_IO_EVENTS
+#ifdef WITH_IO_URING
+    if ((loop->poll_fd > 0) && (LOOP_HAS_IO(loop))) {
+        // interest changes and the wait share a single io_uring_enter
+        _private_uring_flush_polls(loop);
+        _private_uring_enter(loop, 1, sleep_val);
+        return _private_uring_dispatch(loop);
+    } else
+#else
+#ifdef WITH_EPOLL
+    if ((loop->poll_fd > 0) && (LOOP_HAS_IO(loop))) {
+        // events left by the budget are handled before waiting again
+        if (loop->wait_next < loop->wait_count) {
+            int first = loop->wait_next;
+            loop->wait_next = _private_loop_dispatch_wait(loop, loop->wait_events, first, loop->wait_count, 1);
+            return loop->wait_next - first;
+        }
+        struct epoll_event fallback;
+        struct epoll_event *events = &fallback;
+        int max_events = 1;
+        if ((loop->wait_events) || (!_private_loop_resize_wait(loop, DOOPS_WAIT_EVENTS_MIN))) {
+            events = loop->wait_events;
+            max_events = loop->wait_events_size;
+        }
+        int timeout = (sleep_val < 0) ? -1 : (sleep_val + 999) / 1000;
+        if ((sleep_val > 0) && (sleep_val % 1000) && (!_private_loop_arm_timer(loop, sleep_val)))
+            timeout = -1;
+        int nfds = epoll_wait(loop->poll_fd, events, max_events, timeout);
+        int next = _private_loop_dispatch_wait(loop, events, 0, nfds, 0);
+        // the fallback holds a single event, always dispatched
+        if (next < nfds) {
+            loop->wait_next = next;
+            loop->wait_count = nfds;
+        } else
+        if (events != &fallback)
+            _private_loop_adapt_wait(loop, nfds);
+        return (nfds > 0) ? nfds : 0;
+    } else
+#else
+#ifdef WITH_KQUEUE
+    if ((loop->poll_fd > 0) && (LOOP_HAS_IO(loop))) {
+        // events left by the budget are handled before waiting again
+        if (loop->wait_next < loop->wait_count) {
+            int first = loop->wait_next;
+            loop->wait_next = _private_loop_dispatch_wait(loop, loop->wait_events, first, loop->wait_count, 1);
+            return loop->wait_next - first;
+        }
+        struct kevent fallback;
+        struct kevent *events = &fallback;
+        int max_events = 1;
+        if ((loop->wait_events) || (!_private_loop_resize_wait(loop, DOOPS_WAIT_EVENTS_MIN))) {
+            events = loop->wait_events;
+            max_events = loop->wait_events_size;
+        }
+        struct timespec timeout_spec;
+        if (sleep_val >= 0) {
+            timeout_spec.tv_sec = sleep_val / 1000000;
+            timeout_spec.tv_nsec = (sleep_val % 1000000) * 1000;
+        }
+        int events_count = kevent(loop->poll_fd, NULL, 0, events, max_events, (sleep_val >= 0) ? &timeout_spec : NULL);
+        int next = _private_loop_dispatch_wait(loop, events, 0, events_count, 0);
+        if (next < events_count) {
+            loop->wait_next = next;
+            loop->wait_count = events_count;
+        } else
+        if (events != &fallback)
+            _private_loop_adapt_wait(loop, events_count);
+        return (events_count > 0) ? events_count : 0;
+    } else
+#else
+    if ((loop->max_fd) && (LOOP_HAS_IO(loop))) {
+#ifdef WITH_POLL
+        int err = poll(loop->fds, loop->max_fd, (sleep_val < 0) ? -1 : (sleep_val + 999) / 1000);
+        if (err >= 0) {
+            if (!err)
+                return 0;
+            int count = loop->max_fd;
+            // starts where the budget stopped the previous dispatch, the skipped descriptors are still ready
+            int start = ((loop->io_resume > 0) && (loop->io_resume <= count)) ? loop->io_resume - 1 : count - 1;
+            unsigned int dispatched = 0;
+            uint64_t now = loop->budget_us ? microseconds() : 0;
+            int n;
+            loop->io_resume = 0;
+            // backwards: entries moved by loop_remove_io were already visited and have revents cleared
+            for (n = 0; n < count; n ++) {
+                int i = (start >= n) ? start - n : start - n + count;
+                if (i >= loop->max_fd)
+                    continue;
+                int fd = loop->fds[i].fd;
+                short revents = loop->fds[i].revents;
+                if (!revents)
+                    continue;
+                loop->fds[i].revents = 0;
+                if (_private_loop_internal_io(loop, fd))
+                    continue;
+                if (revents & ~POLLOUT)
+                    _private_loop_io_read(loop, fd, DOOPS_UDATA(loop, fd));
+                // the read handler may have removed the fd
+                if ((revents & POLLOUT) && (fd < loop->fd_table_size) && (loop->fd_table[fd].poll_slot))
+                    _private_loop_io_write(loop, fd, DOOPS_UDATA(loop, fd));
+                if ((n < count - 1) && (_private_loop_budget_exhausted(loop, ++ dispatched, now))) {
+                    loop->io_resume = i ? i : count;
+                    break;
+                }
+            }
+        }
+#else
+        struct timeval tout;
+        tout.tv_sec = 0;
+        tout.tv_usec = 0;
+        if (sleep_val > 0) {
+            tout.tv_sec = sleep_val / 1000000;
+            tout.tv_usec = sleep_val % 1000000;
+        }
+        fd_set inlist;
+        fd_set outlist;
+        fd_set exceptlist;
+
+        // fd_set is a struct
+        inlist = loop->inlist;
+        outlist = loop->outlist;
+        exceptlist = loop->exceptlist;
+        int err = select(loop->max_fd, &inlist, &outlist, &exceptlist, (sleep_val < 0) ? NULL : &tout);
+        if (err >= 0) {
+            if (!err)
+                return 0;
+            int count = loop->max_fd;
+            // starts where the budget stopped the previous dispatch, the skipped descriptors are still ready
+            int start = (loop->io_resume < count) ? loop->io_resume : 0;
+            unsigned int dispatched = 0;
+            uint64_t now = loop->budget_us ? microseconds() : 0;
+            int n;
+            loop->io_resume = 0;
+            for (n = 0; n < count; n ++) {
+                int i = (start + n) % count;
+                if ((!FD_ISSET(i, &inlist)) && (!FD_ISSET(i, &outlist)) && (!FD_ISSET(i, &exceptlist)))
+                    continue;
+                if ((FD_ISSET(i, &inlist)) && (_private_loop_internal_io(loop, i)))
+                    continue;
+                if ((FD_ISSET(i, &inlist)) || (FD_ISSET(i, &exceptlist)))
+                    _private_loop_io_read(loop, i, DOOPS_UDATA(loop, i));
+                if (FD_ISSET(i, &outlist))
+                    _private_loop_io_write(loop, i, DOOPS_UDATA(loop, i));
+                if ((n < count - 1) && (_private_loop_budget_exhausted(loop, ++ dispatched, now))) {
+                    loop->io_resume = (i + 1) % count;
+                    break;
+                }
+            }
+        }
+#endif
+        return (err > 0) ? err : 0;
+    } else
+#endif
+#endif
+#endif
+#endif
+    // nothing can interrupt the sleep
+    if (sleep_val < 0)
+        sleep_val = DOOPS_MAX_SLEEP * 1000;
+#ifdef _WIN32
+    Sleep((sleep_val + 999) / 1000);
+#else
+    usleep(sleep_val);
+#endif
+    return 0;
+}
+
+// spins with non-blocking waits for up to spin_us before blocking
+static void _private_loop_wait(struct doops_loop *loop, int sleep_val) {
+    if ((loop->spin_us <= 0) || (!sleep_val)) {
+        _private_sleep(loop, sleep_val);
+        return;
+    }
+    uint64_t start = microseconds();
+    uint64_t now = start;
+    // a negative sleep_val waits for I/O only
+    uint64_t spin = ((sleep_val < 0) || (loop->spin_us < sleep_val)) ? (uint64_t)loop->spin_us : (uint64_t)sleep_val;
+    do {
+        if ((_private_sleep(loop, 0) > 0) || (_private_loop_peek_tasks(loop)) || (loop->deferred_count) || (loop->quit)) {
+            loop->spin_time += microseconds() - start;
+            loop->spin_hits ++;
+            return;
+        }
+        now = microseconds();
+    } while ((now >= start) && (now - start < spin));
+    if (now < start)
+        now = start;
+    loop->spin_time += now - start;
+    // nothing arrived, block for the rest of the interval
+    if ((sleep_val < 0) || ((uint64_t)sleep_val > now - start)) {
+        _private_sleep(loop, (sleep_val < 0) ? -1 : sleep_val - (int)(now - start));
+        uint64_t end = microseconds();
+        if (end > now)
+            loop->sleep_time += end - now;
+    }
+}
+
+// upper limit of the epoll/kqueue wait buffer, no effect on the other backends
+static int loop_set_max_events(struct doops_loop *loop, int max_events) {
+    if ((!loop) || (max_events < 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+#if defined(WITH_EPOLL) || defined(WITH_KQUEUE)
+    // a larger buffer is released after the next wait
+    loop->wait_events_max = max_events;
+#endif
+    return 0;
+}
+
+// limits the timers and the I/O events handled by each iteration, the rest is handled by the next one;
+// max_callbacks and max_us apply separately to the timers and to the I/O events, 0 is unlimited;
+// max_fd_events limits the connections accepted by a listener and the reads of a stream per notification
+static int loop_set_budget(struct doops_loop *loop, unsigned int max_callbacks, unsigned int max_us, unsigned int max_fd_events) {
+    if (!loop) {
+        errno = EINVAL;
+        return -1;
+    }
+    loop->budget_callbacks = max_callbacks;
+    loop->budget_us = max_us;
+    loop->budget_fd_events = max_fd_events;
+    return 0;
+}
+
+// spin_us: poll without blocking for up to spin_us microseconds before each blocking wait
+// busy_poll_us: SO_BUSY_POLL value set on the registered sockets (Linux), 0 turns it off
+static int loop_set_busy_poll(struct doops_loop *loop, int spin_us, int busy_poll_us) {
+    if ((!loop) || (spin_us < 0) || (busy_poll_us < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    loop->spin_us = spin_us;
+    if (busy_poll_us != loop->busy_poll_us) {
+        int fd;
+        for (fd = 0; fd < loop->fd_table_size; fd ++) {
+            if (loop->fd_table[fd].interest & DOOPS_IO_REGISTERED)
+                _private_loop_busy_poll_fd(fd, busy_poll_us);
+        }
+        loop->busy_poll_us = busy_poll_us;
+    }
+    return 0;
+}
+
+// time spent spinning and blocked after spinning (microseconds), and the number of spins that found work; only counted while spin_us is set
+static int loop_busy_poll_stats(struct doops_loop *loop, uint64_t *spin_us, uint64_t *sleep_us, uint64_t *spin_hits) {
+    if (!loop) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (spin_us)
+        *spin_us = loop->spin_time;
+    if (sleep_us)
+        *sleep_us = loop->sleep_time;
+    if (spin_hits)
+        *spin_hits = loop->spin_hits;
+    return 0;
+}
+
+// blocks until the next timer or I/O, the idle loop no longer wakes every DOOPS_MAX_SLEEP ms; needs the wake up descriptor (not on Windows)
+static int loop_set_tickless(struct doops_loop *loop, int enabled) {
+    if (!loop) {
+        errno = EINVAL;
+        return -1;
+    }
+    loop->tickless = enabled ? 1 : 0;
+    return 0;
+}
+
+static void loop_io_wait(struct doops_loop *loop, unsigned char wait) {
+    if (loop)
+        loop->io_wait = wait;
+}
+
+static void loop_run(struct doops_loop *loop) {
+    if (!loop)
+        return;
+
+#if !defined(DOOPS_NO_IO_EVENTS) && !defined(_WIN32)
+    _private_loop_init_wakeup(loop);
+#endif
+    int sleep_val;
+    while (((loop->events) || (_private_loop_peek_tasks(loop)) || (loop->deferred_count) || (loop->offload_pending) || ((loop->io_wait) && (loop->io_objects))) && (!loop->quit)) {
+        loop->event_fd = -1;
+        int loops = _private_loop_iterate(loop, &sleep_val);
+        loop->event_data = NULL;
+        if ((sleep_val) && (!loops) && (loop->idle) && (loop->idle(loop))) {
+            loop->sleeping = 0;
+            break;
+        }
+        // quit requested by a callback, don't wait for the next event
+        if (!loop->quit) {
+#ifdef DOOPS_STATS
+            uint64_t start = microseconds();
+            uint64_t io_events = loop->stats.io_events;
+            uint64_t callback_us = loop->stats.callback_us;
+            _private_loop_wait(loop, sleep_val);
+            // the I/O callbacks run inside _private_sleep, don't count them as waiting
+            uint64_t now = microseconds();
+            uint64_t wait_us = (now > start) ? now - start : 0;
+            callback_us = loop->stats.callback_us - callback_us;
+            wait_us = (wait_us > callback_us) ? wait_us - callback_us : 0;
+            io_events = loop->stats.io_events - io_events;
+            loop->stats.waits ++;
+            loop->stats.wait_us += wait_us;
+            if (io_events > loop->stats.max_io_events)
+                loop->stats.max_io_events = io_events;
+            _private_loop_stats_add(loop->stats.wait_hist, wait_us);
+            _private_loop_stats_add(loop->stats.io_events_hist, io_events);
+#else
+            _private_loop_wait(loop, sleep_val);
+#endif
+        }
+        loop->sleeping = 0;
+    }
+    _private_loop_remove_events(loop);
+    loop->quit = 1;
+}
+
+#ifdef DOOPS_SIGNALS
+#if !defined(__linux__) && !defined(WITH_KQUEUE)
+// self-pipe fallback, signals are delivered to a single loop
+static volatile int _private_loop_signal_write_fd = -1;
+
+static void _private_loop_signal_handler(int signo) {
+    int saved_errno = errno;
+    unsigned char value = (unsigned char)signo;
+    if (write(_private_loop_signal_write_fd, &value, 1) < 0)
+        value = 0;
+    errno = saved_errno;
+}
+#endif
+
+#if defined(__linux__) || defined(WITH_KQUEUE)
+// loops of the process watching each signal
+static int _private_loop_signal_watchers[DOOPS_MAX_SIGNAL];
+#endif
+#ifndef __linux__
+// disposition replaced while the signal is watched
+static struct sigaction _private_loop_signal_saved[DOOPS_MAX_SIGNAL];
+#endif
+
+#ifndef WITH_KQUEUE
+static void _private_loop_signal_read(struct doops_loop *loop, int fd) {
+#ifdef __linux__
+    struct signalfd_siginfo info[16];
+#else
+    unsigned char info[64];
+#endif
+    ssize_t len;
+    while ((len = read(fd, info, sizeof(info))) > 0) {
+        unsigned int i;
+        for (i = 0; i < (unsigned int)len / sizeof(info[0]); i ++) {
+#ifdef __linux__
+            _private_loop_signal(loop, (int)info[i].ssi_signo);
+#else
+            _private_loop_signal(loop, (int)info[i]);
+#endif
+        }
+        // the last handler was removed by the callback
+        if (loop->signal_fd != fd)
+            break;
+    }
+}
+
+static void _private_loop_signal_close(struct doops_loop *loop) {
+    if (loop->signal_fd <= 0)
+        return;
+    // was not counted in io_objects
+    loop->io_objects ++;
+    loop_remove_io(loop, loop->signal_fd);
+    close(loop->signal_fd);
+#if !defined(__linux__)
+    close(_private_loop_signal_write_fd);
+    _private_loop_signal_write_fd = -1;
+#endif
+    loop->signal_fd = 0;
+}
+
+static int _private_loop_signal_open(struct doops_loop *loop, int fd) {
+    // like the wake up descriptor, it doesn't keep the loop alive
+    if (loop_add_io_cb(loop, fd, DOOPS_READ, _private_loop_signal_read, NULL, NULL))
+        return -1;
+    loop->io_objects --;
+    loop->signal_fd = fd;
+    return 0;
+}
+#endif
+
+static int _private_loop_signal_update(struct doops_loop *loop, int signo, int enable) {
+#ifdef __linux__
+    sigset_t mask;
+    sigset_t change;
+    sigemptyset(&mask);
+    sigemptyset(&change);
+    sigaddset(&change, signo);
+    int i;
+    int count = 0;
+    for (i = 1; i < DOOPS_MAX_SIGNAL; i ++) {
+        if (loop->signal_callbacks[i]) {
+            sigaddset(&mask, i);
+            count ++;
+        }
+    }
+    // blocked signals are only reported by the signalfd
+    if (enable) {
+#ifdef DOOPS_NO_THREADS
+        sigprocmask(SIG_BLOCK, &change, NULL);
+#else
+        pthread_sigmask(SIG_BLOCK, &change, NULL);
+#endif
+    }
+    if (count) {
+        int fd = signalfd((loop->signal_fd > 0) ? loop->signal_fd : -1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if ((fd >= 0) && (loop->signal_fd <= 0) && (_private_loop_signal_open(loop, fd))) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0) {
+            // the signal could not be watched
+            if ((enable) && (!_private_loop_signal_watchers[signo])) {
+#ifdef DOOPS_NO_THREADS
+                sigprocmask(SIG_UNBLOCK, &change, NULL);
+#else
+                pthread_sigmask(SIG_UNBLOCK, &change, NULL);
+#endif
+            }
+            return -1;
+        }
+    } else
+        _private_loop_signal_close(loop);
+    if (enable) {
+        __sync_fetch_and_add(&_private_loop_signal_watchers[signo], 1);
+        return 0;
+    }
+    // still read by the signalfd of another loop
+    if (!__sync_sub_and_fetch(&_private_loop_signal_watchers[signo], 1)) {
+#ifdef DOOPS_NO_THREADS
+        sigprocmask(SIG_UNBLOCK, &change, NULL);
+#else
+        pthread_sigmask(SIG_UNBLOCK, &change, NULL);
+#endif
+    }
+    return 0;
+#else
+#ifdef WITH_KQUEUE
+    _private_loop_init_io(loop);
+    struct kevent event;
+    EV_SET(&event, signo, EVFILT_SIGNAL, enable ? (EV_ADD | EV_ENABLE) : EV_DELETE, 0, 0, 0);
+    if (kevent(loop->poll_fd, &event, 1, NULL, 0, NULL))
+        return -1;
+    // kqueue still reports ignored signals, the previous action must not run
+    if (enable) {
+        if (!__sync_fetch_and_add(&_private_loop_signal_watchers[signo], 1)) {
+            struct sigaction action;
+            memset(&action, 0, sizeof(struct sigaction));
+            action.sa_handler = SIG_IGN;
+            sigemptyset(&action.sa_mask);
+            sigaction(signo, &action, &_private_loop_signal_saved[signo]);
+        }
+    } else
+    if (!__sync_sub_and_fetch(&_private_loop_signal_watchers[signo], 1))
+        sigaction(signo, &_private_loop_signal_saved[signo], NULL);
+    return 0;
+#else
+    if ((enable) && (loop->signal_fd <= 0)) {
+        if (_private_loop_signal_write_fd >= 0) {
+            errno = EBUSY;
+            return -1;
+        }
+        int fds[2];
+        if (pipe(fds))
+            return -1;
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        if (_private_loop_signal_open(loop, fds[0])) {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        _private_loop_signal_write_fd = fds[1];
+    }
+    if (enable) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(struct sigaction));
+        action.sa_handler = _private_loop_signal_handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(signo, &action, &_private_loop_signal_saved[signo]))
+            return -1;
+    } else
+    if (sigaction(signo, &_private_loop_signal_saved[signo], NULL))
+        return -1;
+    int i;
+    for (i = 1; i < DOOPS_MAX_SIGNAL; i ++) {
+        if (loop->signal_callbacks[i])
+            return 0;
+    }
+    _private_loop_signal_close(loop);
+    return 0;
+#endif
+#endif
+}
+
+// callback runs on the loop thread as a regular event, NULL removes it and restores the previous action
+static int loop_on_signal(struct doops_loop *loop, int signo, doop_signal_callback callback) {
+    if ((!loop) || (signo <= 0) || (signo >= DOOPS_MAX_SIGNAL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!loop->signal_callbacks) {
+        if (!callback)
+            return 0;
+        loop->signal_callbacks = (doop_signal_callback *)_private_loop_malloc(loop, sizeof(doop_signal_callback) * DOOPS_MAX_SIGNAL);
+        if (!loop->signal_callbacks) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(loop->signal_callbacks, 0, sizeof(doop_signal_callback) * DOOPS_MAX_SIGNAL);
+    }
+    doop_signal_callback previous = loop->signal_callbacks[signo];
+    loop->signal_callbacks[signo] = callback;
+    // only the callback changed
+    if ((!previous) == (!callback))
+        return 0;
+    if (_private_loop_signal_update(loop, signo, callback != NULL)) {
+        loop->signal_callbacks[signo] = previous;
+        return -1;
+    }
+    return 0;
+}
+
+static void _private_loop_signal_free(struct doops_loop *loop) {
+    if (!loop->signal_callbacks)
+        return;
+    int i;
+    for (i = 1; i < DOOPS_MAX_SIGNAL; i ++) {
+        if (loop->signal_callbacks[i])
+            loop_on_signal(loop, i, NULL);
+    }
+    _private_loop_free(loop, loop->signal_callbacks);
+    loop->signal_callbacks = NULL;
+}
+#endif
+
+#ifndef DOOPS_NO_THREADS
+#ifndef DOOPS_OFFLOAD_QUEUE
+    #define DOOPS_OFFLOAD_QUEUE 1024
+#endif
+
+// the task is the first member, _private_loop_run_tasks releases the job after calling done
+struct doops_offload_job {
+    struct doops_task task;
+    doop_work_callback work;
+    doop_work_done_callback done;
+    void *data;
+    int result;
+    struct doops_offload_job *next;
+};
+
+struct doops_offload {
+    struct doops_loop *loop;
+    DOOPS_MUTEX_TYPE lock;
+    DOOPS_COND_TYPE cond;
+    DOOPS_THREAD_TYPE *threads;
+    unsigned int threads_count;
+    // jobs waiting for a worker, oldest first
+    struct doops_offload_job *head;
+    struct doops_offload_job *tail;
+    unsigned int queued;
+    unsigned int max_queued;
+    unsigned int running;
+    int stop;
+};
+
+static unsigned int _private_loop_cpu_count() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    if (info.dwNumberOfProcessors > 0)
+        return (unsigned int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > 0)
+        return (unsigned int)count;
+#endif
+    return 1;
+}
+
+static void _private_offload_lock(struct doops_offload *pool) {
+#ifdef _WIN32
+    EnterCriticalSection(&pool->lock);
+#else
+    pthread_mutex_lock(&pool->lock);
+#endif
+}
+
+static void _private_offload_unlock(struct doops_offload *pool) {
+#ifdef _WIN32
+    LeaveCriticalSection(&pool->lock);
+#else
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+// runs on the loop thread
+static int _private_offload_complete(struct doops_loop *loop) {
+    struct doops_offload_job *job = (struct doops_offload_job *)loop->event_data;
+    loop->offload_pending --;
+    loop->event_data = job->data;
+    if (job->done)
+        job->done(loop, job->result, job->data);
+    return 0;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI _private_offload_thread(LPVOID arg) {
+#else
+static void *_private_offload_thread(void *arg) {
+#endif
+    struct doops_offload *pool = (struct doops_offload *)arg;
+    _private_offload_lock(pool);
+    while (1) {
+        while ((!pool->head) && (!pool->stop)) {
+#ifdef _WIN32
+            SleepConditionVariableCS(&pool->cond, &pool->lock, INFINITE);
+#else
+            pthread_cond_wait(&pool->cond, &pool->lock);
+#endif
+        }
+        if (pool->stop)
+            break;
+        struct doops_offload_job *job = pool->head;
+        pool->head = job->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        pool->queued --;
+        pool->running ++;
+        _private_offload_unlock(pool);
+
+        job->result = job->work(job->data);
+
+        _private_offload_lock(pool);
+        pool->running --;
+        // completions finished while the loop is busy are delivered with a single wake up
+        if (!_private_loop_push_task(pool->loop, &job->task))
+            loop_wakeup(pool->loop);
+    }
+    _private_offload_unlock(pool);
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// stops the workers, the jobs that didn't start are discarded without calling done
+static void _private_offload_free(struct doops_loop *loop) {
+    struct doops_offload *pool = loop->offload;
+    if (!pool)
+        return;
+    _private_offload_lock(pool);
+    pool->stop = 1;
+#ifdef _WIN32
+    WakeAllConditionVariable(&pool->cond);
+#else
+    pthread_cond_broadcast(&pool->cond);
+#endif
+    _private_offload_unlock(pool);
+    unsigned int i;
+    for (i = 0; i < pool->threads_count; i ++) {
+#ifdef _WIN32
+        WaitForSingleObject(pool->threads[i], INFINITE);
+        CloseHandle(pool->threads[i]);
+#else
+        pthread_join(pool->threads[i], NULL);
+#endif
+    }
+    while (pool->head) {
+        struct doops_offload_job *next = pool->head->next;
+        DOOPS_FREE(pool->head);
+        pool->head = next;
+    }
+#ifdef _WIN32
+    DeleteCriticalSection(&pool->lock);
+#else
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+#endif
+    DOOPS_FREE(pool->threads);
+    DOOPS_FREE(pool);
+    loop->offload = NULL;
+    loop->offload_pending = 0;
+}
+
+// threads = 0 starts one worker per CPU core, max_queued = 0 uses DOOPS_OFFLOAD_QUEUE
+static int loop_offload_init(struct doops_loop *loop, unsigned int threads, unsigned int max_queued) {
+    if (!loop) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (loop->offload) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (!threads)
+        threads = _private_loop_cpu_count();
+    if (!max_queued)
+        max_queued = DOOPS_OFFLOAD_QUEUE;
+#if !defined(DOOPS_NO_IO_EVENTS) && !defined(_WIN32)
+    _private_loop_init_wakeup(loop);
+#endif
+    struct doops_offload *pool = (struct doops_offload *)DOOPS_MALLOC(sizeof(struct doops_offload));
+    if (!pool) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(pool, 0, sizeof(struct doops_offload));
+    pool->threads = (DOOPS_THREAD_TYPE *)DOOPS_MALLOC(sizeof(DOOPS_THREAD_TYPE) * threads);
+    if (!pool->threads) {
+        DOOPS_FREE(pool);
+        errno = ENOMEM;
+        return -1;
+    }
+    pool->loop = loop;
+    pool->max_queued = max_queued;
+#ifdef _WIN32
+    InitializeCriticalSection(&pool->lock);
+    InitializeConditionVariable(&pool->cond);
+#else
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+#endif
+    loop->offload = pool;
+    unsigned int i;
+    for (i = 0; i < threads; i ++) {
+#ifdef _WIN32
+        pool->threads[i] = CreateThread(NULL, 0, _private_offload_thread, pool, 0, NULL);
+        if (!pool->threads[i])
+            break;
+#else
+        if (pthread_create(&pool->threads[i], NULL, _private_offload_thread, pool))
+            break;
+#endif
+        pool->threads_count ++;
+    }
+    // runs with fewer workers if some threads could not be created
+    if (!pool->threads_count) {
+        _private_offload_free(loop);
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+// must be called on the loop thread; work(data) runs on a worker, done(loop, result, data) on the loop thread
+static int loop_offload(struct doops_loop *loop, doop_work_callback work, doop_work_done_callback done, void *data) {
+    if ((!loop) || (!work)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((!loop->offload) && (loop_offload_init(loop, 0, 0)))
+        return -1;
+    struct doops_offload *pool = loop->offload;
+    struct doops_offload_job *job = (struct doops_offload_job *)DOOPS_MALLOC(sizeof(struct doops_offload_job));
+    if (!job) {
+        errno = ENOMEM;
+        return -1;
+    }
+    job->task.callback = _private_offload_complete;
+    job->task.user_data = job;
+    job->task.next = NULL;
+    job->work = work;
+    job->done = done;
+    job->data = data;
+    job->result = 0;
+    job->next = NULL;
+    _private_offload_lock(pool);
+    if (pool->queued >= pool->max_queued) {
+        _private_offload_unlock(pool);
+        DOOPS_FREE(job);
+        errno = EAGAIN;
+        return -1;
+    }
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pool->queued ++;
+#ifdef _WIN32
+    WakeConditionVariable(&pool->cond);
+#else
+    pthread_cond_signal(&pool->cond);
+#endif
+    _private_offload_unlock(pool);
+    loop->offload_pending ++;
+    return 0;
+}
+
+// queued: jobs waiting for a worker, running: jobs being executed
+static int loop_offload_stats(struct doops_loop *loop, unsigned int *threads, unsigned int *queued, unsigned int *running) {
+    if (!loop) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct doops_offload *pool = loop->offload;
+    if (!pool) {
+        if (threads)
+            *threads = 0;
+        if (queued)
+            *queued = 0;
+        if (running)
+            *running = 0;
+        return 0;
+    }
+    _private_offload_lock(pool);
+    if (threads)
+        *threads = pool->threads_count;
+    if (queued)
+        *queued = pool->queued;
+    if (running)
+        *running = pool->running;
+    _private_offload_unlock(pool);
+    return 0;
+}
+#endif
+
+static void loop_deinit(struct doops_loop *loop) {
+    if (loop) {
+#ifndef DOOPS_NO_THREADS
+        // workers post their completions to the loop
+        _private_offload_free(loop);
+#endif
+#ifdef DOOPS_SIGNALS
+        _private_loop_signal_free(loop);
+#endif
+#if defined(WITH_EPOLL) || defined(WITH_KQUEUE) || defined(WITH_IO_URING)
+#ifdef WITH_IO_URING
+        _private_uring_close(loop);
+        _private_loop_free(loop, loop->uring_dirty);
+        loop->uring_dirty = NULL;
+        loop->uring_dirty_count = 0;
+        loop->uring_dirty_size = 0;
+#endif
+#ifdef WITH_EPOLL
+        if (loop->timer_fd > 0) {
+            close(loop->timer_fd);
+            loop->timer_fd = 0;
+        }
+#endif
+#if defined(WITH_EPOLL) || defined(WITH_KQUEUE)
+        _private_loop_free(loop, loop->wait_events);
+        loop->wait_events = NULL;
+        loop->wait_events_size = 0;
+        loop->wait_small_batches = 0;
+        loop->wait_next = 0;
+        loop->wait_count = 0;
+#endif
+        _private_loop_close_wakeup(loop);
+        if (loop->poll_fd > 0) {
+            close(loop->poll_fd);
+            loop->poll_fd = -1;
+        }
+#else
+        _private_loop_close_wakeup(loop);
+#ifdef WITH_POLL
+        _private_loop_free(loop, loop->fds);
+        loop->fds = NULL;
+        loop->max_fd = 0;
+        loop->fds_size = 0;
+#else
+        FD_ZERO(&loop->inlist);
+        FD_ZERO(&loop->outlist);
+        FD_ZERO(&loop->exceptlist);
+        loop->max_fd = 0;
+#endif
+#endif
+        int i;
+        for (i = 0; i < loop->fd_table_size; i ++)
+            _private_loop_release_fd_events(loop, i);
+        _private_loop_remove_events(loop);
+        _private_loop_free(loop, loop->idle_wheel);
+        loop->idle_wheel = NULL;
+        loop->idle_count = 0;
+        memset(&loop->idle_timer, 0, sizeof(struct doops_timer));
+        _private_loop_free_slabs(loop);
+        _private_loop_free(loop, loop->deferred);
+        loop->deferred = NULL;
+        loop->deferred_head = 0;
+        loop->deferred_count = 0;
+        loop->deferred_size = 0;
+        for (i = 0; i < DOOPS_FRAME_CLASSES; i ++) {
+            while (loop->frames[i]) {
+                void *next = *(void **)loop->frames[i];
+                _private_loop_free(loop, loop->frames[i]);
+                loop->frames[i] = next;
+            }
+        }
+        _private_loop_free(loop, loop->fd_table);
+        loop->fd_table = NULL;
+        loop->fd_table_size = 0;
+        // tasks are allocated by the posting threads, not by the loop allocator
+        struct doops_task *tasks = _private_loop_take_tasks(loop);
+        while (tasks) {
+            struct doops_task *next = tasks->next;
+            DOOPS_FREE(tasks);
+            tasks = next;
+        }
+#ifdef WITH_BLOCKS
+        if (loop->io_read_block) {
+            Block_release(loop->io_read_block);
+            loop->io_read_block = NULL;
+        }
+        if (loop->io_write_block) {
+            Block_release(loop->io_write_block);
+            loop->io_write_block = NULL;
+        }
+#endif
+    }
+}
+
+static void loop_free(struct doops_loop *loop) {
+    loop_deinit(loop);
+    DOOPS_FREE(loop);
+}
+
+// copies the counters collected with DOOPS_STATS; called from another thread, the snapshot is approximate
+static int loop_stats(struct doops_loop *loop, struct doops_stats *out) {
+    if ((!loop) || (!out)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(out, 0, sizeof(struct doops_stats));
+#ifdef DOOPS_STATS
+    *out = loop->stats;
+    out->pending_timers = loop->timers_count;
+    out->io_objects = loop->io_objects;
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+static int loop_event_socket(struct doops_loop *loop) {
+    if (loop)
+        return loop->event_fd;
+    return -1;
+}
+
+static void *loop_event_data(struct doops_loop *loop) {
+    if (loop)
+        return loop->event_data;
+    return NULL;
+}
+
+#ifdef WITH_IO_URING
+static int _private_uring_op(struct doops_loop *loop, unsigned char opcode, int fd, void *buffer, unsigned int len, unsigned char multishot, doop_uring_callback callback, void *data) {
+    if ((!loop) || (fd < 0) || (!callback)) {
+        errno = EINVAL;
+        return -1;
+    }
+    _private_loop_init_io(loop);
+    if (loop->poll_fd <= 0)
+        return -1;
+    struct doops_uring_op *op = (struct doops_uring_op *)_private_loop_malloc(loop, sizeof(struct doops_uring_op));
+    if (!op) {
+        errno = ENOMEM;
+        return -1;
+    }
+    op->callback = callback;
+    op->data = data;
+    op->buffer = buffer;
+    op->len = len;
+    op->fd = fd;
+    op->opcode = opcode;
+    op->multishot = multishot;
+    if (_private_uring_submit_op(loop, op)) {
+        _private_loop_free(loop, op);
+        return -1;
+    }
+    // pending requests keep the loop running
+    loop->io_objects ++;
+    return 0;
+}
+
+// completion-based I/O: callback receives the read(2)/write(2)/accept(2) result or -errno
+static int loop_uring_read(struct doops_loop *loop, int fd, void *buffer, unsigned int len, doop_uring_callback callback, void *data) {
+    return _private_uring_op(loop, IORING_OP_READ, fd, buffer, len, 0, callback, data);
+}
+
+static int loop_uring_write(struct doops_loop *loop, int fd, const void *buffer, unsigned int len, doop_uring_callback callback, void *data) {
+    return _private_uring_op(loop, IORING_OP_WRITE, fd, (void *)buffer, len, 0, callback, data);
+}
+
+// callback is called for every accepted (non-blocking) socket until loop_uring_cancel
+static int loop_uring_accept(struct doops_loop *loop, int fd, doop_uring_callback callback, void *data) {
+    return _private_uring_op(loop, IORING_OP_ACCEPT, fd, NULL, 0, 1, callback, data);
+}
+
+static int loop_uring_cancel(struct doops_loop *loop, int fd) {
+    if ((!loop) || (fd < 0) || (loop->poll_fd <= 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+#ifdef IORING_ASYNC_CANCEL_FD
+    struct io_uring_sqe *sqe = _private_uring_sqe(loop);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = DOOPS_URING_IGNORE;
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+#endif
+
+#if !defined(_WIN32) && !defined(DOOPS_NO_IO_EVENTS)
+// buffer sizes are powers of two
+#ifndef DOOPS_STREAM_BUFFER
+    #define DOOPS_STREAM_BUFFER         4096
+#endif
+#ifndef DOOPS_STREAM_MAX_READ
+    #define DOOPS_STREAM_MAX_READ       0x100000
+#endif
+#ifndef DOOPS_STREAM_HIGH_WATERMARK
+    #define DOOPS_STREAM_HIGH_WATERMARK 0x10000
+#endif
+
+#define DOOPS_STREAM_INPUT_FULL     0x01
+#define DOOPS_STREAM_OUTPUT_FULL    0x02
+#define DOOPS_STREAM_ENDING         0x04
+#define DOOPS_STREAM_NOT_SOCKET     0x08
+
+struct doops_stream;
+
+typedef void (*doop_stream_callback)(struct doops_stream *stream);
+
+// power of two sized ring, head and tail are free running counters
+struct doops_ring {
+    unsigned char *data;
+    unsigned int size;
+    unsigned int head;
+    unsigned int tail;
+};
+
+struct doops_stream {
+    struct doops_loop *loop;
+    int fd;
+    struct doops_ring in;
+    struct doops_ring out;
+    // reading stops while more than high_watermark bytes are queued for writing
+    unsigned int high_watermark;
+    // read buffer limit (power of two), reading stops while it is full
+    unsigned int max_read;
+    doop_stream_callback on_data;
+    doop_stream_callback on_drain;
+    doop_stream_callback on_close;
+    void *user_data;
+    // errno of the failed read/write, 0 on end of stream
+    int error;
+    unsigned char flags;
+    // reads continued on the next iteration (loop_set_budget)
+    struct doops_timer resume;
+};
+
+static unsigned int _private_ring_used(const struct doops_ring *ring) {
+    return ring->tail - ring->head;
+}
+
+// grows the ring so it can hold at least size bytes, limit is 0 or a power of two
+static int _private_ring_reserve(struct doops_loop *loop, struct doops_ring *ring, unsigned int size, unsigned int limit) {
+    if (size <= ring->size)
+        return 0;
+    unsigned int new_size = ring->size ? ring->size : DOOPS_STREAM_BUFFER;
+    while (new_size < size)
+        new_size *= 2;
+    if ((limit) && (new_size > limit)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    unsigned char *data = (unsigned char *)_private_loop_malloc(loop, new_size);
+    if (!data) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // linearize the used bytes
+    unsigned int used = _private_ring_used(ring);
+    if (used) {
+        unsigned int offset = ring->head & (ring->size - 1);
+        unsigned int first = ring->size - offset;
+        if (first > used)
+            first = used;
+        memcpy(data, ring->data + offset, first);
+        memcpy(data + first, ring->data, used - first);
+    }
+    _private_loop_free(loop, ring->data);
+    ring->data = data;
+    ring->size = new_size;
+    ring->head = 0;
+    ring->tail = used;
+    return 0;
+}
+
+// free: describes the empty space instead of the used bytes
+static int _private_ring_iov(struct doops_ring *ring, struct iovec *iov, int free) {
+    if (!ring->size)
+        return 0;
+    unsigned int len = free ? ring->size - _private_ring_used(ring) : _private_ring_used(ring);
+    if (!len)
+        return 0;
+    unsigned int offset = (free ? ring->tail : ring->head) & (ring->size - 1);
+    unsigned int first = ring->size - offset;
+    if (first > len)
+        first = len;
+    iov[0].iov_base = ring->data + offset;
+    iov[0].iov_len = first;
+    if (first == len)
+        return 1;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+static void _private_ring_push(struct doops_ring *ring, const void *data, unsigned int len) {
+    unsigned int offset = ring->tail & (ring->size - 1);
+    unsigned int first = ring->size - offset;
+    if (first > len)
+        first = len;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, (const unsigned char *)data + first, len - first);
+    ring->tail += len;
+}
+
+static void _private_ring_consume(struct doops_ring *ring, unsigned int len) {
+    ring->head += len;
+    // empty, restart at offset 0 to keep the next read/write in a single segment
+    if (ring->head == ring->tail) {
+        ring->head = 0;
+        ring->tail = 0;
+    }
+}
+
+static void _private_stream_update_read(struct doops_stream *stream) {
+    if (stream->flags & (DOOPS_STREAM_INPUT_FULL | DOOPS_STREAM_OUTPUT_FULL))
+        loop_pause_read_io(stream->loop, stream->fd);
+    else
+        loop_resume_read_io(stream->loop, stream->fd);
+}
+
+static ssize_t _private_stream_writev(struct doops_stream *stream, const struct iovec *iov, int count) {
+#ifdef MSG_NOSIGNAL
+    // no SIGPIPE when the peer is gone
+    if (!(stream->flags & DOOPS_STREAM_NOT_SOCKET)) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = count;
+        ssize_t written = sendmsg(stream->fd, &msg, MSG_NOSIGNAL);
+        if ((written >= 0) || (errno != ENOTSOCK))
+            return written;
+        stream->flags |= DOOPS_STREAM_NOT_SOCKET;
+    }
+#endif
+    return writev(stream->fd, iov, count);
+}
+
+// returns -1 on error, 0 when everything was written, 1 if data is still queued
+static int _private_stream_flush(struct doops_stream *stream) {
+    struct iovec iov[2];
+    int count;
+    while ((count = _private_ring_iov(&stream->out, iov, 0)) > 0) {
+        ssize_t written = _private_stream_writev(stream, iov, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return 1;
+            stream->error = errno;
+            return -1;
+        }
+        _private_ring_consume(&stream->out, (unsigned int)written);
+    }
+    return 0;
+}
+
+static void _private_stream_closed(struct doops_stream *stream) {
+    loop_remove_io(stream->loop, stream->fd);
+    // may release the stream
+    if (stream->on_close)
+        stream->on_close(stream);
+}
+
+static void _private_stream_on_write(struct doops_loop *loop, int fd) {
+    struct doops_stream *stream = (struct doops_stream *)loop_event_data(loop);
+    int err = _private_stream_flush(stream);
+    if (err > 0)
+        return;
+    if (err < 0) {
+        _private_stream_closed(stream);
+        return;
+    }
+    loop_pause_write_io(loop, fd);
+    if (stream->flags & DOOPS_STREAM_ENDING) {
+        _private_stream_closed(stream);
+        return;
+    }
+    if (stream->flags & DOOPS_STREAM_OUTPUT_FULL) {
+        stream->flags &= ~DOOPS_STREAM_OUTPUT_FULL;
+        _private_stream_update_read(stream);
+    }
+    if (stream->on_drain)
+        stream->on_drain(stream);
+}
+
+static int _private_stream_continue(struct doops_loop *loop);
+
+static void _private_stream_on_read(struct doops_loop *loop, int fd) {
+    struct doops_stream *stream = (struct doops_stream *)loop_event_data(loop);
+    unsigned int reads = 0;
+    // edge-triggered: read until EAGAIN, end of stream or a full buffer
+    while (1) {
+        int closed = 0;
+        int full = 0;
+        int yield = 0;
+        while (1) {
+            struct iovec iov[2];
+            if ((_private_ring_used(&stream->in) == stream->in.size) && (_private_ring_reserve(loop, &stream->in, stream->in.size + 1, stream->max_read))) {
+                full = 1;
+                break;
+            }
+            ssize_t bytes = readv(fd, iov, _private_ring_iov(&stream->in, iov, 1));
+            if (bytes > 0) {
+                stream->in.tail += (unsigned int)bytes;
+                // per-fd budget, let the other descriptors run
+                if ((loop->budget_fd_events) && (++ reads >= loop->budget_fd_events)) {
+                    yield = 1;
+                    break;
+                }
+                continue;
+            }
+            if (!bytes) {
+                stream->error = 0;
+                closed = 1;
+            } else
+            if (errno == EINTR) {
+                continue;
+            } else
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                stream->error = errno;
+                closed = 1;
+            }
+            break;
+        }
+        if ((_private_ring_used(&stream->in)) && (stream->on_data)) {
+            stream->on_data(stream);
+            // closed by on_data
+            if (stream->fd < 0)
+                return;
+        }
+        if (closed) {
+            _private_stream_closed(stream);
+            return;
+        }
+        if (yield) {
+            // the kernel will not notify again for the data left in the socket
+            if ((!stream->resume.event) && (loop->fd_table[fd].interest & DOOPS_IO_READ))
+                stream->resume = _private_loop_add_internal(loop, _private_stream_continue, 0, stream);
+            return;
+        }
+        if (!full)
+            return;
+        // on_data made room, the kernel will not notify again for the remaining data
+        if (_private_ring_used(&stream->in) < stream->in.size)
+            continue;
+        stream->flags |= DOOPS_STREAM_INPUT_FULL;
+        _private_stream_update_read(stream);
+        return;
+    }
+}
+
+static int _private_stream_continue(struct doops_loop *loop) {
+    struct doops_stream *stream = (struct doops_stream *)loop_event_data(loop);
+    stream->resume.event = NULL;
+    // reading may have been paused since
+    if ((stream->fd >= 0) && (loop->fd_table[stream->fd].interest & DOOPS_IO_READ))
+        _private_stream_on_read(loop, stream->fd);
+    return 1;
+}
+
+// fd is set to non-blocking mode; on_close (end of stream or error) should call loop_stream_close,
+// it is the only callback where the stream memory may be released
+static int loop_stream_init(struct doops_loop *loop, struct doops_stream *stream, int fd, doop_stream_callback on_data, doop_stream_callback on_close, void *user_data) {
+    if ((!loop) || (!stream) || (fd < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(stream, 0, sizeof(struct doops_stream));
+    stream->loop = loop;
+    stream->fd = fd;
+    stream->high_watermark = DOOPS_STREAM_HIGH_WATERMARK;
+    stream->max_read = DOOPS_STREAM_MAX_READ;
+    stream->on_data = on_data;
+    stream->on_close = on_close;
+    stream->user_data = user_data;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    // write interest is added only while data is queued
+    if (loop_add_io_cb(loop, fd, DOOPS_READ, _private_stream_on_read, _private_stream_on_write, stream)) {
+        stream->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void loop_stream_on_drain(struct doops_stream *stream, doop_stream_callback on_drain) {
+    if (stream)
+        stream->on_drain = on_drain;
+}
+
+// returns -1 on error, 0 if accepted, 1 if above the high watermark (wait for on_drain)
+static int loop_stream_writev(struct doops_stream *stream, const struct iovec *iov, int count) {
+    if ((!stream) || (stream->fd < 0) || (count < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (stream->flags & DOOPS_STREAM_ENDING) {
+        errno = EPIPE;
+        return -1;
+    }
+    int i;
+    size_t total = 0;
+    for (i = 0; i < count; i ++)
+        total += iov[i].iov_len;
+    size_t written = 0;
+    // nothing queued: write directly, only the remainder is buffered
+    if ((!_private_ring_used(&stream->out)) && (total)) {
+        ssize_t bytes;
+        do {
+            bytes = _private_stream_writev(stream, iov, count);
+        } while ((bytes < 0) && (errno == EINTR));
+        if (bytes < 0) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                stream->error = errno;
+                return -1;
+            }
+            bytes = 0;
+        }
+        written = (size_t)bytes;
+        if (written == total)
+            return 0;
+    }
+    if (_private_ring_reserve(stream->loop, &stream->out, _private_ring_used(&stream->out) + (unsigned int)(total - written), 0))
+        return -1;
+    for (i = 0; i < count; i ++) {
+        size_t len = iov[i].iov_len;
+        if (written >= len) {
+            written -= len;
+            continue;
+        }
+        _private_ring_push(&stream->out, (const unsigned char *)iov[i].iov_base + written, (unsigned int)(len - written));
+        written = 0;
+    }
+    loop_resume_write_io(stream->loop, stream->fd);
+    if (_private_ring_used(&stream->out) > stream->high_watermark) {
+        if (!(stream->flags & DOOPS_STREAM_OUTPUT_FULL)) {
+            stream->flags |= DOOPS_STREAM_OUTPUT_FULL;
+            _private_stream_update_read(stream);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static int loop_stream_write(struct doops_stream *stream, const void *data, size_t len) {
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    return loop_stream_writev(stream, &iov, 1);
+}
+
+static unsigned int loop_stream_available(struct doops_stream *stream) {
+    if (!stream)
+        return 0;
+    return _private_ring_used(&stream->in);
+}
+
+static unsigned int loop_stream_pending(struct doops_stream *stream) {
+    if (!stream)
+        return 0;
+    return _private_ring_used(&stream->out);
+}
+
+// contiguous readable bytes, call loop_stream_consume after processing them
+static unsigned int loop_stream_peek(struct doops_stream *stream, void **data) {
+    struct iovec iov[2];
+    if ((!stream) || (!_private_ring_iov(&stream->in, iov, 0))) {
+        if (data)
+            *data = NULL;
+        return 0;
+    }
+    if (data)
+        *data = iov[0].iov_base;
+    return (unsigned int)iov[0].iov_len;
+}
+
+static void loop_stream_consume(struct doops_stream *stream, unsigned int len) {
+    if (!stream)
+        return;
+    if (len > _private_ring_used(&stream->in))
+        len = _private_ring_used(&stream->in);
+    _private_ring_consume(&stream->in, len);
+    if ((stream->flags & DOOPS_STREAM_INPUT_FULL) && (stream->fd >= 0)) {
+        stream->flags &= ~DOOPS_STREAM_INPUT_FULL;
+        _private_stream_update_read(stream);
+    }
+}
+
+static unsigned int loop_stream_read(struct doops_stream *stream, void *buffer, unsigned int len) {
+    unsigned int copied = 0;
+    while (copied < len) {
+        void *data;
+        unsigned int available = loop_stream_peek(stream, &data);
+        if (!available)
+            break;
+        if (available > len - copied)
+            available = len - copied;
+        memcpy((unsigned char *)buffer + copied, data, available);
+        loop_stream_consume(stream, available);
+        copied += available;
+    }
+    return copied;
+}
+
+// removes the fd from the loop and releases the buffers; the fd is not closed
+static void loop_stream_close(struct doops_stream *stream) {
+    if ((!stream) || (!stream->loop))
+        return;
+    if (stream->fd >= 0)
+        loop_remove_io(stream->loop, stream->fd);
+    stream->fd = -1;
+    if (stream->resume.event) {
+        loop_timer_cancel(&stream->resume);
+        stream->resume.event = NULL;
+    }
+    _private_loop_free(stream->loop, stream->in.data);
+    _private_loop_free(stream->loop, stream->out.data);
+    memset(&stream->in, 0, sizeof(struct doops_ring));
+    memset(&stream->out, 0, sizeof(struct doops_ring));
+}
+
+// stops reading, on_close is called from the loop once the queued data is written
+static int loop_stream_end(struct doops_stream *stream) {
+    if ((!stream) || (stream->fd < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    stream->flags |= DOOPS_STREAM_ENDING;
+    loop_pause_read_io(stream->loop, stream->fd);
+    // the write handler closes the stream, even if nothing is queued
+    return loop_resume_write_io(stream->loop, stream->fd);
+}
+#endif
+
+#if !defined(_WIN32) && !defined(DOOPS_NO_IO_EVENTS)
+// bytes sent per writable notification before yielding to the other descriptors
+#ifndef DOOPS_SENDFILE_CHUNK
+    #define DOOPS_SENDFILE_CHUNK    0x100000
+#endif
+
+// result is the number of bytes sent or -errno
+typedef void (*doop_sendfile_callback)(struct doops_loop *loop, int sock_fd, int64_t result, void *data);
+
+struct doops_sendfile {
+    doop_sendfile_callback on_done;
+    void *data;
+    int sock_fd;
+    int file_fd;
+    off_t offset;
+    uint64_t remaining;
+    uint64_t sent;
+    // pending continuation (chunk sent)
+    struct doops_timer resume;
+};
+
+// returns bytes sent, 0 on end of file, -1 on error
+static int64_t _private_sendfile(int sock_fd, int file_fd, off_t *offset, size_t len) {
+#if defined(__linux__)
+    ssize_t sent = sendfile(sock_fd, file_fd, offset, len);
+    return (int64_t)sent;
+#elif defined(__FreeBSD__)
+    off_t sent = 0;
+    if ((sendfile(file_fd, sock_fd, *offset, len, NULL, &sent, 0)) && (!sent))
+        return -1;
+    *offset += sent;
+    return (int64_t)sent;
+#elif defined(__APPLE__)
+    off_t sent = (off_t)len;
+    if ((sendfile(file_fd, sock_fd, *offset, &sent, NULL, 0)) && (!sent))
+        return -1;
+    *offset += sent;
+    return (int64_t)sent;
+#else
+    // no sendfile, copy through a buffer
+    unsigned char buffer[0x4000];
+    if (len > sizeof(buffer))
+        len = sizeof(buffer);
+    ssize_t bytes = pread(file_fd, buffer, len, *offset);
+    if (bytes <= 0)
+        return (int64_t)bytes;
+#ifdef MSG_NOSIGNAL
+    ssize_t sent = send(sock_fd, buffer, (size_t)bytes, MSG_NOSIGNAL);
+    if ((sent < 0) && (errno == ENOTSOCK))
+        sent = write(sock_fd, buffer, (size_t)bytes);
+#else
+    ssize_t sent = write(sock_fd, buffer, (size_t)bytes);
+#endif
+    if (sent > 0)
+        *offset += sent;
+    return (int64_t)sent;
+#endif
+}
+
+static void _private_sendfile_done(struct doops_loop *loop, struct doops_sendfile *op, int64_t result) {
+    doop_sendfile_callback on_done = op->on_done;
+    void *data = op->data;
+    int sock_fd = op->sock_fd;
+    loop_remove_io(loop, sock_fd);
+    _private_loop_free(loop, op);
+    // the socket can be registered again by on_done
+    if (on_done)
+        on_done(loop, sock_fd, result, data);
+}
+
+static int _private_sendfile_continue(struct doops_loop *loop);
+
+// returns 1 when the transfer is complete, with its result
+static int _private_sendfile_send(struct doops_loop *loop, struct doops_sendfile *op, int64_t *result) {
+    uint64_t budget = DOOPS_SENDFILE_CHUNK;
+    while (op->remaining) {
+        if (!budget) {
+            // more data may be sent, but the edge-triggered registration won't report it again
+            op->resume = _private_loop_add_internal(loop, _private_sendfile_continue, 0, op);
+            return 0;
+        }
+        size_t len = (size_t)(op->remaining < budget ? op->remaining : budget);
+        int64_t sent = _private_sendfile(op->sock_fd, op->file_fd, &op->offset, len);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return 0;
+            *result = -(int64_t)errno;
+            return 1;
+        }
+        // file is shorter than expected
+        if (!sent)
+            break;
+        op->sent += (uint64_t)sent;
+        op->remaining -= (uint64_t)sent;
+        budget -= (uint64_t)sent;
+    }
+    *result = (int64_t)op->sent;
+    return 1;
+}
+
+static void _private_sendfile_run(struct doops_loop *loop, struct doops_sendfile *op) {
+    int64_t result = 0;
+#if defined(__linux__) && defined(DOOPS_SIGNALS)
+    // sendfile has no MSG_NOSIGNAL, the SIGPIPE raised by a closed peer is blocked and discarded
+    sigset_t pipe_mask;
+    sigset_t saved_mask;
+    sigset_t pending;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+#ifdef DOOPS_NO_THREADS
+    sigprocmask(SIG_BLOCK, &pipe_mask, &saved_mask);
+#else
+    pthread_sigmask(SIG_BLOCK, &pipe_mask, &saved_mask);
+#endif
+    sigpending(&pending);
+    int was_pending = sigismember(&pending, SIGPIPE);
+#endif
+    int done = _private_sendfile_send(loop, op, &result);
+#if defined(__linux__) && defined(DOOPS_SIGNALS)
+    if ((result == -EPIPE) && (!was_pending)) {
+        int signo;
+        sigpending(&pending);
+        if (sigismember(&pending, SIGPIPE))
+            sigwait(&pipe_mask, &signo);
+    }
+#ifdef DOOPS_NO_THREADS
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+#else
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+#endif
+#endif
+    if (done)
+        _private_sendfile_done(loop, op, result);
+}
+
+static int _private_sendfile_continue(struct doops_loop *loop) {
+    struct doops_sendfile *op = (struct doops_sendfile *)loop_event_data(loop);
+    op->resume.event = NULL;
+    _private_sendfile_run(loop, op);
+    return 1;
+}
+
+static void _private_sendfile_on_write(struct doops_loop *loop, int fd) {
+    struct doops_sendfile *op = (struct doops_sendfile *)loop_event_data(loop);
+    (void)fd;
+    // a continuation is already queued
+    if (op->resume.event)
+        return;
+    _private_sendfile_run(loop, op);
+}
+
+// sends len bytes (0 = up to the end of the file) from file_fd at offset, without changing the file position;
+// sock_fd must not be registered with the loop until on_done is called or the transfer is cancelled.
+// A closed peer is reported as -EPIPE, SIGPIPE is not raised (except on Linux in strict ISO C builds, where it must be ignored)
+static int loop_sendfile(struct doops_loop *loop, int sock_fd, int file_fd, int64_t offset, uint64_t len, doop_sendfile_callback on_done, void *data) {
+    if ((!loop) || (sock_fd < 0) || (file_fd < 0) || (offset < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((sock_fd < loop->fd_table_size) && (loop->fd_table[sock_fd].interest & DOOPS_IO_REGISTERED)) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (!len) {
+        struct stat st;
+        if (fstat(file_fd, &st))
+            return -1;
+        if (st.st_size > offset)
+            len = (uint64_t)(st.st_size - offset);
+    }
+    struct doops_sendfile *op = (struct doops_sendfile *)_private_loop_malloc(loop, sizeof(struct doops_sendfile));
+    if (!op) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(op, 0, sizeof(struct doops_sendfile));
+    op->on_done = on_done;
+    op->data = data;
+    op->sock_fd = sock_fd;
+    op->file_fd = file_fd;
+    op->offset = (off_t)offset;
+    op->remaining = len;
+    fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(sock_fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    // the first write notification starts the transfer
+    if (loop_add_io_cb(loop, sock_fd, 2, NULL, _private_sendfile_on_write, op)) {
+        _private_loop_free(loop, op);
+        return -1;
+    }
+    return 0;
+}
+
+// stops a pending transfer, on_done is not called and sock_fd is not closed
+static int loop_sendfile_cancel(struct doops_loop *loop, int sock_fd) {
+    if ((!loop) || (sock_fd < 0) || (sock_fd >= loop->fd_table_size) || (loop->fd_table[sock_fd].on_write != _private_sendfile_on_write)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct doops_sendfile *op = (struct doops_sendfile *)DOOPS_UDATA(loop, sock_fd);
+    if (op->resume.event)
+        loop_timer_cancel(&op->resume);
+    loop_remove_io(loop, sock_fd);
+    _private_loop_free(loop, op);
+    return 0;
+}
+#endif
+
+#if !defined(_WIN32) && !defined(DOOPS_NO_IO_EVENTS)
+// connections accepted per notification before yielding to the other descriptors
+#ifndef DOOPS_ACCEPT_BATCH
+    #define DOOPS_ACCEPT_BATCH      64
+#endif
+// retry interval (ms) when the process runs out of descriptors
+#ifndef DOOPS_ACCEPT_RETRY
+    #define DOOPS_ACCEPT_RETRY      100
+#endif
+
+// fd is the accepted socket, already registered for read notifications with data as user data
+typedef void (*doop_accept_callback)(struct doops_loop *loop, int fd, void *data);
+
+struct doops_listener {
+    doop_accept_callback on_accept;
+    void *data;
+    int fd;
+    // pending continuation (batch limit reached or EMFILE)
+    struct doops_timer resume;
+};
+
+static int _private_listener_continue(struct doops_loop *loop);
+
+static void _private_listener_on_read(struct doops_loop *loop, int fd);
+
+static void _private_listener_accept(struct doops_loop *loop, struct doops_listener *listener) {
+    int listener_fd = listener->fd;
+    int accepted = 0;
+    int batch = loop->budget_fd_events ? (int)loop->budget_fd_events : DOOPS_ACCEPT_BATCH;
+    while (accepted < batch) {
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+        int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int fd = accept(listener->fd, NULL, NULL);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        if (fd < 0) {
+            if ((errno == EINTR) || (errno == ECONNABORTED) || (errno == EPROTO))
+                continue;
+            // the pending connections will not be notified again, retry later
+            if ((errno == EMFILE) || (errno == ENFILE) || (errno == ENOBUFS) || (errno == ENOMEM))
+                listener->resume = _private_loop_add_internal(loop, _private_listener_continue, DOOPS_ACCEPT_RETRY, listener);
+            return;
+        }
+        accepted ++;
+        if (loop_add_io_data(loop, fd, DOOPS_READ, listener->data)) {
+            close(fd);
+            continue;
+        }
+        if (listener->on_accept) {
+            listener->on_accept(loop, fd, listener->data);
+            // on_accept may have called loop_remove_listener, freeing listener
+            if ((listener_fd >= loop->fd_table_size) || (loop->fd_table[listener_fd].on_read != _private_listener_on_read) || (DOOPS_UDATA(loop, listener_fd) != listener))
+                return;
+        }
+    }
+    // edge-triggered: connections left in the backlog are handled on the next iteration
+    listener->resume = _private_loop_add_internal(loop, _private_listener_continue, 0, listener);
+}
+
+static int _private_listener_continue(struct doops_loop *loop) {
+    struct doops_listener *listener = (struct doops_listener *)loop_event_data(loop);
+    listener->resume.event = NULL;
+    _private_listener_accept(loop, listener);
+    return 1;
+}
+
+static void _private_listener_on_read(struct doops_loop *loop, int fd) {
+    struct doops_listener *listener = (struct doops_listener *)loop_event_data(loop);
+    (void)fd;
+    // a continuation is already queued
+    if (listener->resume.event)
+        return;
+    _private_listener_accept(loop, listener);
+}
+
+// fd is a listening socket, set to non-blocking mode
+static int loop_add_listener(struct doops_loop *loop, int fd, doop_accept_callback on_accept, void *data) {
+    if ((!loop) || (fd < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct doops_listener *listener = (struct doops_listener *)_private_loop_malloc(loop, sizeof(struct doops_listener));
+    if (!listener) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(listener, 0, sizeof(struct doops_listener));
+    listener->on_accept = on_accept;
+    listener->data = data;
+    listener->fd = fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (loop_add_io_cb(loop, fd, DOOPS_READ, _private_listener_on_read, NULL, listener)) {
+        _private_loop_free(loop, listener);
+        return -1;
+    }
+    return 0;
+}
+
+// the listening socket is not closed
+static int loop_remove_listener(struct doops_loop *loop, int fd) {
+    if ((!loop) || (fd < 0) || (fd >= loop->fd_table_size) || (loop->fd_table[fd].on_read != _private_listener_on_read)) {
+        errno = EINVAL;
+        return -1;
     }
-    doops_unlock(&loop->lock);
-    return loops;
+    struct doops_listener *listener = (struct doops_listener *)DOOPS_UDATA(loop, fd);
+    if (listener->resume.event)
+        loop_timer_cancel(&listener->resume);
+    loop_remove_io(loop, fd);
+    _private_loop_free(loop, listener);
+    return 0;
 }
+#endif
 
-static int loop_iterate(struct doops_loop *loop) {
-    return _private_loop_iterate(loop, NULL);
+
+#ifndef DOOPS_NO_THREADS
+typedef int (*doop_socket_factory)(struct doops_loop *loop, unsigned int index, void *data);
+
+struct doops_loop_group {
+    struct doops_loop *loops;
+    DOOPS_THREAD_TYPE *threads;
+    unsigned int count;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI _private_loop_group_thread(LPVOID loop) {
+    loop_run((struct doops_loop *)loop);
+    return 0;
+}
+#else
+static void *_private_loop_group_thread(void *loop) {
+    loop_run((struct doops_loop *)loop);
+    return NULL;
 }
+#endif
 
-static int loop_idle(struct doops_loop *loop, doop_idle_callback callback) {
-    if (!loop) {
+// count = 0 will create a loop for every CPU core
+static int loop_group_init(struct doops_loop_group *group, unsigned int count) {
+    if (!group) {
         errno = EINVAL;
         return -1;
     }
-    loop->idle = callback;
+    if (!count)
+        count = _private_loop_cpu_count();
+    memset(group, 0, sizeof(struct doops_loop_group));
+    group->loops = (struct doops_loop *)DOOPS_MALLOC(sizeof(struct doops_loop) * count);
+    group->threads = (DOOPS_THREAD_TYPE *)DOOPS_MALLOC(sizeof(DOOPS_THREAD_TYPE) * count);
+    if ((!group->loops) || (!group->threads)) {
+        DOOPS_FREE(group->loops);
+        DOOPS_FREE(group->threads);
+        group->loops = NULL;
+        group->threads = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    unsigned int i;
+    for (i = 0; i < count; i ++)
+        loop_init(&group->loops[i]);
+    group->count = count;
     return 0;
 }
 
-static int loop_io(struct doops_loop *loop, doop_io_callback read_callback, doop_io_callback write_callback) {
-    if (!loop) {
+static struct doops_loop *loop_group_loop(struct doops_loop_group *group, unsigned int index) {
+    if ((!group) || (index >= group->count))
+        return NULL;
+    return &group->loops[index];
+}
+
+static int loop_group_io(struct doops_loop_group *group, doop_io_callback read_callback, doop_io_callback write_callback) {
+    if (!group) {
         errno = EINVAL;
         return -1;
     }
-    loop->io_read = read_callback;
-    loop->io_write = write_callback;
-#ifdef WITH_BLOCK
-    if (loop->io_read_block) {
-        Block_release(loop->io_read_block);
-        loop->io_read_block = NULL;
+    unsigned int i;
+    for (i = 0; i < group->count; i ++)
+        loop_io(&group->loops[i], read_callback, write_callback);
+    return 0;
+}
+
+// one listener shared by all loops (EPOLLEXCLUSIVE on epoll); fd should be non-blocking
+static int loop_group_add_io_data(struct doops_loop_group *group, int fd, int mode, void *userdata) {
+    if (!group) {
+        errno = EINVAL;
+        return -1;
     }
-    if (loop->io_write_block) {
-        Block_release(loop->io_write_block);
-        loop->io_write_block = NULL;
+    unsigned int i;
+    for (i = 0; i < group->count; i ++) {
+        if (_private_loop_add_io_data(&group->loops[i], fd, mode, userdata, 1))
+            return -1;
     }
-#endif
     return 0;
 }
 
-static void _private_loop_remove_events(struct doops_loop *loop) {
-    struct doops_event *next_ev;
-    doops_lock(&loop->lock);
-    while (loop->events) {
-        next_ev = loop->events->next;
-        if ((loop->udata_free) && (loop->events->user_data)) {
-            loop->event_data = loop->events->user_data;
-            loop->udata_free(loop, loop->events->user_data);
-        }
-#ifdef WITH_BLOCKS
-        if ((loop->events) && (loop->events->event_block))
-            Block_release(loop->events->event_block);
-#endif
-        DOOPS_FREE(loop->events);
-        loop->events = next_ev;
+static int loop_group_add_io(struct doops_loop_group *group, int fd, int mode) {
+    return loop_group_add_io_data(group, fd, mode, NULL);
+}
+
+// one listener per loop, created by factory (for example, bound with SO_REUSEPORT)
+static int loop_group_add_io_sharded(struct doops_loop_group *group, doop_socket_factory factory, int mode, void *data) {
+    if ((!group) || (!factory)) {
+        errno = EINVAL;
+        return -1;
     }
-#ifndef WITH_KQUEUE
-    if (loop->udata) {
-        DOOPS_FREE(loop->udata);
-        loop->udata = NULL;
+    unsigned int i;
+    for (i = 0; i < group->count; i ++) {
+        int fd = factory(&group->loops[i], i, data);
+        if (fd < 0)
+            return -1;
+        if (loop_add_io_data(&group->loops[i], fd, mode, data))
+            return -1;
     }
-    loop->max_fd = 1;
-#endif
-    doops_unlock(&loop->lock);
+    return 0;
 }
 
-static void _private_sleep(struct doops_loop *loop, int sleep_val) {
-    if (!loop)
+static void loop_group_quit(struct doops_loop_group *group) {
+    if (!group)
         return;
-#ifndef DOOPS_NO_IO_EVENTS
-#ifdef WITH_EPOLL
-    if ((loop->poll_fd > 0) && ((LOOP_IS_READABLE(loop)) || (LOOP_IS_WRITABLE(loop)))) {
-        struct epoll_event events[DOOPS_MAX_EVENTS];
-        int nfds = epoll_wait(loop->poll_fd, events, DOOPS_MAX_EVENTS, sleep_val);
-        int i;
-        for (i = 0; i < nfds; i ++) {
-            if (LOOP_IS_WRITABLE(loop)) {
-                if (events[i].events & EPOLLOUT) {
-                    loop->event_fd = events[i].data.fd;
-                    loop->event_data = loop->udata ? loop->udata[events[i].data.fd] : NULL;
-#ifdef WITH_BLOCKS
-                    if (loop->io_write_block)
-                        loop->io_write_block(loop, events[i].data.fd);
-                    else
-#endif
-                    loop->io_write(loop, events[i].data.fd);
-                }
-            }
-            if (LOOP_IS_READABLE(loop)) {
-                if (events[i].events & ~EPOLLOUT) {
-                    loop->event_fd = events[i].data.fd;
-                    loop->event_data = loop->udata ? loop->udata[events[i].data.fd] : NULL;
-#ifdef WITH_BLOCKS
-                    if (loop->io_read_block)
-                        loop->io_read_block(loop, events[i].data.fd);
-                    else
-#endif
-                    loop->io_read(loop, events[i].data.fd);
-                }
-            }
-        }
-    } else
+    unsigned int i;
+    for (i = 0; i < group->count; i ++) {
+        loop_quit(&group->loops[i]);
+        loop_wakeup(&group->loops[i]);
+    }
+}
+
+// runs the first loop on the calling thread and every other loop on its own thread
+static int loop_group_run(struct doops_loop_group *group) {
+    if ((!group) || (!group->count)) {
+        errno = EINVAL;
+        return -1;
+    }
+    unsigned int i;
+    unsigned int started = 1;
+    int err = 0;
+    for (i = 1; i < group->count; i ++) {
+#ifdef _WIN32
+        group->threads[i] = CreateThread(NULL, 0, _private_loop_group_thread, &group->loops[i], 0, NULL);
+        if (!group->threads[i]) {
 #else
-#ifdef WITH_KQUEUE
-    if ((loop->poll_fd > 0) && ((LOOP_IS_READABLE(loop)) || (LOOP_IS_WRITABLE(loop)))) {
-        struct kevent events[DOOPS_MAX_EVENTS];
-        struct timespec timeout_spec;
-        if (sleep_val >= 0) {
-            timeout_spec.tv_sec = sleep_val / 1000;
-            timeout_spec.tv_nsec = (sleep_val % 1000) * 1000;
-        }
-        int events_count = kevent(loop->poll_fd, NULL, 0, events, DOOPS_MAX_EVENTS, (sleep_val >= 0) ? &timeout_spec : NULL);
-        int i;
-        for (i = 0; i < events_count; i ++) {
-            if (LOOP_IS_WRITABLE(loop)) {
-                if (events[i].filter == EVFILT_WRITE) {
-                    loop->event_fd = events[i].ident;
-                    loop->event_data = events[i].udata;
-#ifdef WITH_BLOCKS
-                    if (loop->io_write_block)
-                        loop->io_write_block(loop, events[i].ident);
-                    else
-#endif
-                    loop->io_write(loop, events[i].ident);
-                }
-            }
-            if (LOOP_IS_READABLE(loop)) {
-                if (events[i].filter != EVFILT_WRITE) {
-                    loop->event_fd = events[i].ident;
-                    loop->event_data = events[i].udata;
-#ifdef WITH_BLOCKS
-                    if (loop->io_read_block)
-                        loop->io_read_block(loop, events[i].ident);
-                    else
+        if (pthread_create(&group->threads[i], NULL, _private_loop_group_thread, &group->loops[i])) {
 #endif
-                    loop->io_read(loop, events[i].ident);
-                }
-            }
+            err = -1;
+            loop_group_quit(group);
+            break;
         }
-    } else
+        started ++;
+    }
+    if (!err)
+        loop_run(&group->loops[0]);
+    for (i = 1; i < started; i ++) {
+#ifdef _WIN32
+        WaitForSingleObject(group->threads[i], INFINITE);
+        CloseHandle(group->threads[i]);
 #else
-    if ((loop->max_fd) && ((LOOP_IS_READABLE(loop)) || (LOOP_IS_WRITABLE(loop)))) {
-#ifdef WITH_POLL
-        int err = poll(loop->fds, loop->max_fd, sleep_val);
-        if (err >= 0) {
-            if (!err)
-                return;
-            int i;
-            for (i = 0; i < loop->max_fd; i ++) {
-                if (LOOP_IS_READABLE(loop)) {
-                    if (loop->fds[i].revents & ~POLLOUT) {
-                        loop->event_fd = loop->fds[i].fd;
-                        loop->event_data = loop->udata ? loop->udata[i] : NULL;
-#ifdef WITH_BLOCKS
-                        if (loop->io_read_block)
-                            loop->io_read_block(loop, loop->fds[i].fd);
-                        else
+        pthread_join(group->threads[i], NULL);
 #endif
-                        loop->io_read(loop, loop->fds[i].fd);
-                    }
-                }
-                if (LOOP_IS_WRITABLE(loop)) {
-                    if (loop->fds[i].revents & POLLOUT) {
-                        loop->event_fd = loop->fds[i].fd;
-                        loop->event_data = loop->udata ? loop->udata[i] : NULL;
-#ifdef WITH_BLOCKS
-                        if (loop->io_write_block)
-                            loop->io_write_block(loop, loop->fds[i].fd);
-                        else
+    }
+    return err;
+}
+
+static void loop_group_deinit(struct doops_loop_group *group) {
+    if (!group)
+        return;
+    unsigned int i;
+    for (i = 0; i < group->count; i ++)
+        loop_deinit(&group->loops[i]);
+    DOOPS_FREE(group->loops);
+    DOOPS_FREE(group->threads);
+    group->loops = NULL;
+    group->threads = NULL;
+    group->count = 0;
+}
 #endif
-                        loop->io_write(loop, loop->fds[i].fd);
-                    }
+
+#ifdef DOOPS_FUNCTORS
+namespace doops {
+    // timer callables are called as f(loop) or f(), a non-zero result removes the timer (void keeps it)
+    template <typename F>
+    auto call_timer(F &f, struct doops_loop *loop, int) -> decltype(f(*loop)) { return f(*loop); }
+    template <typename F>
+    auto call_timer(F &f, struct doops_loop *, long) -> decltype(f()) { return f(); }
+
+    template <typename F>
+    int timer_result(F &f, struct doops_loop *loop, std::true_type) {
+        call_timer(f, loop, 0);
+        return 0;
+    }
+
+    template <typename F>
+    int timer_result(F &f, struct doops_loop *loop, std::false_type) {
+        return call_timer(f, loop, 0) ? 1 : 0;
+    }
+
+    // fd callables are called as f(loop, fd) or f(fd)
+    template <typename F>
+    auto call_io(F &f, struct doops_loop *loop, int fd, int) -> decltype(f(*loop, fd)) { return f(*loop, fd); }
+    template <typename F>
+    auto call_io(F &f, struct doops_loop *, int fd, long) -> decltype(f(fd)) { return f(fd); }
+
+    // returns the event (and the callable storage) to the loop unless ev is cleared
+    struct event_guard {
+        struct doops_loop *loop;
+        struct doops_event *ev;
+        void *ptr;
+
+        ~event_guard() {
+            if (ptr)
+                _private_loop_free(loop, ptr);
+            if (ev)
+                _private_loop_discard_event(loop, ev);
+        }
+    };
+
+    template <typename F>
+    struct callable {
+        static const bool inline_storage = (sizeof(F) <= DOOPS_EVENT_STORAGE) && (alignof(F) <= alignof(decltype(doops_event::storage)));
+
+        static F *get(struct doops_event *ev) {
+            return inline_storage ? (F *)(void *)ev->storage.bytes : (F *)ev->storage.ptr;
+        }
+
+        template <typename T>
+        static int store(event_guard &guard, T &&callback) {
+            static_assert(alignof(F) <= alignof(std::max_align_t), "over-aligned callables are not supported");
+            void *ptr = guard.ev->storage.bytes;
+            if (!inline_storage) {
+                ptr = _private_loop_malloc(guard.loop, sizeof(F));
+                if (!ptr) {
+                    errno = ENOMEM;
+                    return -1;
                 }
+                guard.ptr = ptr;
             }
+            new (ptr) F(std::forward<T>(callback));
+            guard.ptr = NULL;
+            if (!inline_storage)
+                guard.ev->storage.ptr = ptr;
+            guard.ev->storage_free = destroy;
+            return 0;
         }
-#else
-        struct timeval tout;
-        tout.tv_sec = 0;
-        tout.tv_usec = 0;
-        if (sleep_val > 0) {
-            tout.tv_sec = sleep_val / 1000;
-            tout.tv_usec = (sleep_val % 1000) * 1000;
+
+        static void destroy(struct doops_loop *loop, struct doops_event *ev) {
+            F *f = get(ev);
+            f->~F();
+            if (!inline_storage)
+                _private_loop_free(loop, f);
         }
-        fd_set inlist;
-        fd_set outlist;
-        fd_set exceptlist;
 
-        // fd_set is a struct
-        inlist = loop->inlist;
-        outlist = loop->outlist;
-        exceptlist = loop->exceptlist;
-        int err = select(loop->max_fd, &inlist, &outlist, &exceptlist, &tout);
-        if (err >= 0) {
-            if (!err)
+        static int run_timer(struct doops_loop *loop) {
+            F &f = *get(loop->in_event);
+            return timer_result(f, loop, std::is_void<decltype(call_timer(f, loop, 0))>());
+        }
+
+        static void run_io(struct doops_loop *loop, int fd, struct doops_event *ev) {
+            if (!ev)
                 return;
-            int i;
-            for (i = 0; i < loop->max_fd; i ++) {
-                if (LOOP_IS_READABLE(loop)) {
-                    if ((FD_ISSET(i, &inlist)) || (FD_ISSET(i, &exceptlist))) {
-                        loop->event_fd = i;
-                        loop->event_data = loop->udata ? loop->udata[i] : NULL;
+            // loop_remove_io or a new callable for the fd keeps it alive until it returns
+            ev->flags |= DOOPS_EVENT_RUNNING;
+            call_io(*get(ev), loop, fd, 0);
+            ev->flags &= ~DOOPS_EVENT_RUNNING;
+            if (ev->flags & DOOPS_EVENT_RELEASED)
+                _private_loop_release_event(loop, ev);
+        }
+
+        static void run_read(struct doops_loop *loop, int fd) {
+            run_io(loop, fd, loop->fd_table[fd].read_event);
+        }
+
+        static void run_write(struct doops_loop *loop, int fd) {
+            run_io(loop, fd, loop->fd_table[fd].write_event);
+        }
+    };
+
+    // timer.event is NULL on error
+    template <typename T>
+    struct doops_timer schedule_callable(struct doops_loop *loop, T &&callback, int64_t interval_us, unsigned int flags) {
+        typedef typename std::decay<T>::type F;
+        struct doops_timer timer;
+        memset(&timer, 0, sizeof(struct doops_timer));
+        if (!loop) {
+            errno = EINVAL;
+            return timer;
+        }
+        event_guard guard = { loop, _private_loop_alloc_event(loop), NULL };
+        if ((!guard.ev) || (callable<F>::store(guard, std::forward<T>(callback))))
+            return timer;
+        guard.ev->event_callback = callable<F>::run_timer;
 #ifdef WITH_BLOCKS
-                        if (loop->io_read_block)
-                            loop->io_read_block(loop, i);
-                        else
+        guard.ev->event_block = NULL;
 #endif
-                        loop->io_read(loop, i);
-                    }
-                }
-                if (LOOP_IS_WRITABLE(loop)) {
-                    if (FD_ISSET(i, &outlist)) {
-                        loop->event_fd = i;
-                        loop->event_data = loop->udata ? loop->udata[i] : NULL;
+        if (!_private_loop_schedule_event(loop, guard.ev, interval_us, NULL, flags, &timer))
+            guard.ev = NULL;
+        return timer;
+    }
+
+    // registers fd if needed and replaces its read or write callable
+    template <typename T>
+    int set_io_callable(struct doops_loop *loop, int fd, unsigned char interest, T &&callback) {
+        typedef typename std::decay<T>::type F;
+        if ((!loop) || (fd < 0)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (_private_loop_fd_table(loop, fd))
+            return -1;
+        // awaited by a coroutine
+        if ((loop->fd_table[fd].read_waiter) || (loop->fd_table[fd].write_waiter)) {
+            errno = EBUSY;
+            return -1;
+        }
+        event_guard guard = { loop, _private_loop_alloc_event(loop), NULL };
+        if ((!guard.ev) || (callable<F>::store(guard, std::forward<T>(callback))))
+            return -1;
+        guard.ev->event_callback = NULL;
 #ifdef WITH_BLOCKS
-                        if (loop->io_write_block)
-                            loop->io_write_block(loop, i);
-                        else
+        guard.ev->event_block = NULL;
 #endif
-                        loop->io_write(loop, i);
-                    }
-                }
-            }
+        guard.ev->user_data = NULL;
+        guard.ev->flags = 0;
+        guard.ev->prev = NULL;
+        guard.ev->next = NULL;
+        if (loop->fd_table[fd].interest & DOOPS_IO_REGISTERED) {
+            if (_private_loop_pause_io(loop, fd, interest, 1))
+                return -1;
+        } else
+        if (loop_add_io_data(loop, fd, (interest == DOOPS_IO_WRITE) ? 2 : DOOPS_READ, NULL))
+            return -1;
+        struct doops_fd *fd_state = &loop->fd_table[fd];
+        struct doops_event *previous;
+        if (interest == DOOPS_IO_READ) {
+            previous = fd_state->read_event;
+            fd_state->read_event = guard.ev;
+            fd_state->on_read = callable<F>::run_read;
+        } else {
+            previous = fd_state->write_event;
+            fd_state->write_event = guard.ev;
+            fd_state->on_write = callable<F>::run_write;
         }
-#endif
-    } else
-#endif
-#endif
-#endif
-#ifdef _WIN32
-    Sleep(sleep_val);
-#else
-    usleep(sleep_val * 1000);
-#endif
+        guard.ev = NULL;
+        if (previous)
+            _private_loop_release_event(loop, previous);
+        return 0;
+    }
 }
 
-static void loop_io_wait(struct doops_loop *loop, unsigned char wait) {
-    if (loop)
-        loop->io_wait = wait;
+template <typename F>
+inline struct doops_timer doops_loop::schedule(F &&callback, int64_t interval) {
+    return doops::schedule_callable(this, std::forward<F>(callback), interval * 1000, 0);
 }
 
-static void loop_run(struct doops_loop *loop) {
-    if (!loop)
+template <typename F>
+inline struct doops_timer doops_loop::schedule_us(F &&callback, int64_t interval_us) {
+    return doops::schedule_callable(this, std::forward<F>(callback), interval_us, DOOPS_EVENT_PRECISE);
+}
+
+template <typename F>
+inline int doops_loop::on_read(int fd, F &&callback) {
+    return doops::set_io_callable(this, fd, DOOPS_IO_READ, std::forward<F>(callback));
+}
+
+template <typename F>
+inline int doops_loop::on_write(int fd, F &&callback) {
+    return doops::set_io_callable(this, fd, DOOPS_IO_WRITE, std::forward<F>(callback));
+}
+#endif
+
+#ifdef DOOPS_COROUTINES
+// resumed from the loop, the fd stays registered between two awaits
+static void _private_loop_resume_read(struct doops_loop *loop, int fd) {
+    void *waiter = loop->fd_table[fd].read_waiter;
+    // nobody is waiting, level-triggered backends would report it on every iteration
+    if (!waiter) {
+        loop_pause_read_io(loop, fd);
         return;
+    }
+    loop->fd_table[fd].read_waiter = NULL;
+    std::coroutine_handle<>::from_address(waiter).resume();
+}
 
-    int sleep_val;
-    while (((loop->events) || ((loop->io_wait) && (loop->io_objects))) && (!loop->quit)) {
-        loop->event_fd = -1;
-        int loops = _private_loop_iterate(loop, &sleep_val);
-        loop->event_data = NULL;
-        if ((sleep_val > 0) && (!loops) && (loop->idle) && (loop->idle(loop)))
-            break;
-        _private_sleep(loop, sleep_val);
+static void _private_loop_resume_write(struct doops_loop *loop, int fd) {
+    void *waiter = loop->fd_table[fd].write_waiter;
+    if (!waiter) {
+        loop_pause_write_io(loop, fd);
+        return;
     }
-    _private_loop_remove_events(loop);
-    loop->quit = 1;
+    loop->fd_table[fd].write_waiter = NULL;
+    std::coroutine_handle<>::from_address(waiter).resume();
 }
 
-static void loop_deinit(struct doops_loop *loop) {
-    if (loop) {
-#if defined(WITH_EPOLL) || defined(WITH_KQUEUE)
-        if (loop->poll_fd > 0) {
-            close(loop->poll_fd);
-            loop->poll_fd = -1;
+static int _private_loop_resume_timer(struct doops_loop *loop) {
+    std::coroutine_handle<>::from_address(loop->event_data).resume();
+    return 1;
+}
+
+static int _private_loop_await_io(struct doops_loop *loop, int fd, unsigned char interest, void *waiter) {
+    if ((!loop) || (fd < 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((fd >= loop->fd_table_size) || (!(loop->fd_table[fd].interest & DOOPS_IO_REGISTERED))) {
+        if (loop_add_io_cb(loop, fd, (interest == DOOPS_IO_WRITE) ? 2 : DOOPS_READ, _private_loop_resume_read, _private_loop_resume_write, NULL))
+            return -1;
+    } else {
+        struct doops_fd *fd_state = &loop->fd_table[fd];
+        if ((fd_state->on_read != _private_loop_resume_read) || (fd_state->on_write != _private_loop_resume_write)) {
+            // handled by callbacks
+            if ((fd_state->on_read) || (fd_state->on_write)) {
+                errno = EBUSY;
+                return -1;
+            }
+            fd_state->on_read = _private_loop_resume_read;
+            fd_state->on_write = _private_loop_resume_write;
         }
-#else
-#ifdef WITH_POLL
-        DOOPS_FREE(loop->fds);
-        DOOPS_FREE(loop->udata);
-        loop->fds = NULL;
-        loop->udata = NULL;
-        loop->max_fd = 0;
-#else
-        FD_ZERO(&loop->inlist);
-        FD_ZERO(&loop->outlist);
-        FD_ZERO(&loop->exceptlist);
-        DOOPS_FREE(loop->udata);
-        loop->udata = NULL;
-        loop->max_fd = 0;
-#endif
-#endif
-        _private_loop_remove_events(loop);
-#ifdef WITH_BLOCKS
-        if (loop->io_read_block) {
-            Block_release(loop->io_read_block);
-            loop->io_read_block = NULL;
+        // another coroutine is already waiting
+        if (((interest == DOOPS_IO_READ) && (fd_state->read_waiter)) || ((interest == DOOPS_IO_WRITE) && (fd_state->write_waiter))) {
+            errno = EBUSY;
+            return -1;
         }
-        if (loop->io_write_block) {
-            Block_release(loop->io_write_block);
-            loop->io_write_block = NULL;
+        if (_private_loop_pause_io(loop, fd, interest, 1))
+            return -1;
+    }
+    if (interest == DOOPS_IO_READ)
+        loop->fd_table[fd].read_waiter = waiter;
+    else
+        loop->fd_table[fd].write_waiter = waiter;
+    return 0;
+}
+
+namespace doops {
+    struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) frame_header {
+        struct doops_loop *loop;
+        unsigned int size_class;
+    };
+
+    // frames of coroutines taking the loop as first parameter come from the loop, must be called on the loop thread
+    inline void *frame_alloc(struct doops_loop *loop, size_t size) noexcept {
+        frame_header *frame;
+        size += sizeof(frame_header);
+        if (!loop) {
+            frame = (frame_header *)::operator new(size, std::nothrow);
+            if (!frame)
+                return NULL;
+        } else {
+            unsigned int size_class = 0;
+            size_t class_size = DOOPS_FRAME_MIN;
+            while ((class_size < size) && (size_class < DOOPS_FRAME_CLASSES)) {
+                class_size <<= 1;
+                size_class ++;
+            }
+            if (size_class < DOOPS_FRAME_CLASSES) {
+                frame = (frame_header *)loop->frames[size_class];
+                if (frame)
+                    loop->frames[size_class] = *(void **)frame;
+                else
+                    frame = (frame_header *)_private_loop_malloc(loop, class_size);
+            } else
+                frame = (frame_header *)_private_loop_malloc(loop, size);
+            if (!frame)
+                return NULL;
+            frame->size_class = size_class;
         }
-#endif
+        frame->loop = loop;
+        return frame + 1;
+    }
+
+    inline void frame_free(void *ptr) noexcept {
+        frame_header *frame = (frame_header *)ptr - 1;
+        struct doops_loop *loop = frame->loop;
+        if (!loop) {
+            ::operator delete(frame);
+            return;
+        }
+        if (frame->size_class < DOOPS_FRAME_CLASSES) {
+            *(void **)frame = loop->frames[frame->size_class];
+            loop->frames[frame->size_class] = frame;
+        } else
+            _private_loop_free(loop, frame);
     }
+
+    // fire and forget coroutine, runs until its first co_await and is destroyed when it returns
+    struct task {
+        struct promise_type {
+            task get_return_object() noexcept { return task(); }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept { }
+            // exceptions cannot propagate through the loop
+            void unhandled_exception() noexcept { std::terminate(); }
+            static task get_return_object_on_allocation_failure() noexcept { return task(); }
+
+            template <typename... Args>
+            static void *operator new(size_t size, struct doops_loop &loop, Args &&...) noexcept { return frame_alloc(&loop, size); }
+            template <typename... Args>
+            static void *operator new(size_t size, struct doops_loop *loop, Args &&...) noexcept { return frame_alloc(loop, size); }
+            static void *operator new(size_t size) noexcept { return frame_alloc(NULL, size); }
+            static void operator delete(void *ptr) noexcept { frame_free(ptr); }
+        };
+    };
+
+    // co_await returns 0, or -1 with errno set if the fd could not be watched
+    struct io_awaiter {
+        struct doops_loop *loop;
+        int fd;
+        unsigned char interest;
+        int result;
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> handle) noexcept {
+            result = _private_loop_await_io(loop, fd, interest, handle.address());
+            return !result;
+        }
+        int await_resume() const noexcept { return result; }
+    };
+
+    struct sleep_awaiter {
+        struct doops_loop *loop;
+        int64_t interval;
+        // interval is in microseconds
+        bool precise;
+        int result;
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> handle) noexcept {
+            // the coroutine handle is not user data: kept away from udata_free and loop_remove
+            struct doops_timer timer;
+            memset(&timer, 0, sizeof(struct doops_timer));
+            _private_loop_add(loop, _private_loop_resume_timer, precise ? interval : interval * 1000, handle.address(), DOOPS_EVENT_INTERNAL | (precise ? DOOPS_EVENT_PRECISE : 0), &timer);
+            result = timer.event ? 0 : -1;
+            return !result;
+        }
+        int await_resume() const noexcept { return result; }
+    };
 }
 
-static void loop_free(struct doops_loop *loop) {
-    loop_deinit(loop);
-    DOOPS_FREE(loop);
+inline doops::io_awaiter doops_loop::readable(int fd) {
+    return doops::io_awaiter { this, fd, DOOPS_IO_READ, 0 };
 }
 
-static int loop_event_socket(struct doops_loop *loop) {
-    if (loop)
-        return loop->event_fd;
-    return -1;
+inline doops::io_awaiter doops_loop::writable(int fd) {
+    return doops::io_awaiter { this, fd, DOOPS_IO_WRITE, 0 };
 }
 
-static void *loop_event_data(struct doops_loop *loop) {
-    if (loop)
-        return loop->event_data;
-    return NULL;
+inline doops::sleep_awaiter doops_loop::sleep(int64_t interval) {
+    return doops::sleep_awaiter { this, interval, false, 0 };
+}
+
+inline doops::sleep_awaiter doops_loop::sleep_us(int64_t interval_us) {
+    return doops::sleep_awaiter { this, interval_us, true, 0 };
 }
+#endif
 
 #endif